@@ -31,7 +31,6 @@
 #include "cest/cstdlib.hpp"
 #include "cest/deque.hpp"
 #include "cest/fstream.hpp"
-#include "cest/sstream.hpp"
 #include "cest/iostream.hpp"
 #include "cest/iterator.hpp"
 #include "cest/limits.hpp"
@@ -191,19 +190,23 @@ constexpr bool containsonlyupperorq(ns::string token)
     return true;
 }
 
-constexpr ns::string nexttoken(ns::istream & input)
+// Read the next token of text, starting at pos, which is advanced past it.
+// The text is scanned in place, by index, rather than through a stream.
+// Returns an empty token at the end of the text, or if an invalid character
+// is found; in the latter case pos is left before the end of the text.
+constexpr ns::string nexttoken(ns::string const & text,
+                               ns::string::size_type & pos)
 {
-    char ch;
-    ns::string token;
-
     // Skip whitespace
-    while (input.get(ch) && ismmws(ch)) { }
-    if (input.good())
-        input.unget();
+    while (pos < text.size() && ismmws(text[pos]))
+        ++pos;
+
+    ns::string::size_type const start(pos);
 
     // Get token
-    while (input.get(ch) && !ismmws(ch))
+    while (pos < text.size() && !ismmws(text[pos]))
     {
+        char const ch(text[pos]);
         if (ch < '!' || ch > '~')
         {
             ns::cerr << "Invalid character read with code 0x";
@@ -212,13 +215,10 @@ constexpr ns::string nexttoken(ns::istream & input)
             return ns::string();
         }
 
-        token += ch;
+        ++pos;
     }
 
-    if (!input.eof() && input.fail())
-        return ns::string();
-
-    return token;
+    return text.substr(start, pos - start);
 }
 
 //   http://eel.is/c++draft/dcl.constexpr#3.5
@@ -238,21 +238,17 @@ constexpr bool readtokens(ns::string filename, ns::string const &text = "")
     if (alreadyencountered)
         return true;
 
-    ns::istringstream in;
+    // The contents of the file, if text is empty
+    ns::string contents;
 
-    if (!text.empty())
-    {
-        in.str(text);
-    }
-    else
+    if (text.empty())
     {
         bool okay = [&]() // lambda: non-literal values in dead constexpr paths
         {
             ns::ifstream file(filename.c_str());
             if (!file)
                 return false;
-            ns::string str((ns::istreambuf_iterator(file)), {});
-            in.str(str);
+            contents = ns::string((ns::istreambuf_iterator(file)), {});
             return true;
         }();
         if (!okay)
@@ -266,8 +262,11 @@ constexpr bool readtokens(ns::string filename, ns::string const &text = "")
     bool infileinclusion(false);
     ns::string newfilename;
 
+    ns::string const & input(text.empty() ? contents : text);
+    ns::string::size_type pos(0);
+
     ns::string token;
-    while (!(token = nexttoken(in)).empty())
+    while (!(token = nexttoken(input, pos)).empty())
     {
         if (incomment)
         {
@@ -339,12 +338,9 @@ constexpr bool readtokens(ns::string filename, ns::string const &text = "")
         tokens.push(token);
     }
 
-    if (!in.eof())
-    {
-        if (in.fail())
-            ns::cerr << "Error reading from " << filename << ns::endl;
+    // An invalid character was found
+    if (pos < input.size())
         return false;
-    }
 
     if (incomment)
     {
@@ -16,6 +16,19 @@
 // a Metamath database encoded as a C++11 style raw string literal. The
 // trivial delimit.sh bash script is provided to help convert database files to
 // this format. The C'est library is at https://github.com/pkeir/cest
+//
+// Alternatively, with a compiler supporting #embed (e.g. Clang 19 or GCC 15),
+// define MMEMBEDPATH as the path to the database file itself; it is then
+// embedded as a character array, with no delimit.sh step. Where #embed isn't
+// supported, MMFILEPATH is used instead, so both may be defined.
+//
+// Compile-time verification can be split between N compilations, run in
+// parallel, by defining CHECKMM_PARTS as N and CHECKMM_PART as 0 to N-1 in
+// each; each checks the proofs of every Nth theorem.
+//
+// At runtime, gzip and zstd compressed databases are detected and read
+// through a decompressor, if support is compiled in by defining CHECKMM_ZLIB
+// (and linking with -lz) or CHECKMM_ZSTD (and linking with -lzstd).
 
 // wget https://raw.githubusercontent.com/metamath/set.mm/develop/peano.mm
 // bash delimit.sh peano.mm
@@ -26,325 +39,2368 @@
 // clang++ -std=c++2b -Winvalid-constexpr -Wl,-rpath,"$CEST2_ROOT/lib64:$LD_LIBRARY_PATH" -I $CEST2_ROOT/constexpr-std-headers/include/c++/14.0.0 -I $CEST2_ROOT/constexpr-std-headers/include/c++/14.0.0/x86_64-pc-linux-gnu -L $CEST2_ROOT/lib64 -D_GLIBCXX_CEST_CONSTEXPR=constexpr -D_GLIBCXX_CEST_VERSION=1 -fsanitize=address -fconstexpr-steps=2147483647 -DMMFILEPATH=peano.mm.raw ctcheckmm-std.cpp
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <fstream>
-#include <sstream>
+#include <functional>
 #include <iostream>
-#include <iterator>
 #include <limits>
 #include <map>
-#include <queue>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef CHECKMM_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CHECKMM_ZSTD
+#include <zstd.h>
+#endif
+
+// The containers checkmm keeps its database and proofs in are chosen by a
+// policy: the allocator they all use, and the maps in which math symbols,
+// hypotheses and assertions are kept by name, for the parser's lookups.
+// These are the standard allocator and ordered maps, which can be used in
+// constant evaluation.
+struct OrderedContainers
+{
+    template <class T>
+    using allocator = std::allocator<T>;
+
+    template <class T>
+    using namemap = std::map<std::string, T, std::less<> >;
+
+    template <class T>
+    constexpr namemap<T> makenamemap() const { return namemap<T>(); }
+};
+
+// Hashes a name for HashedContainers, so names can be looked up uncopied
+struct NameHash
+{
+    typedef void is_transparent;
+
+    std::size_t operator()(std::string_view const name) const
+    {
+        return std::hash<std::string_view>()(name);
+    }
+};
+
+// Compares names of any string type for HashedContainers
+struct NameEqual
+{
+    typedef void is_transparent;
+
+    bool operator()(std::string_view const lhs,
+                    std::string_view const rhs) const
+    {
+        return lhs == rhs;
+    }
+};
+
+// Polymorphic allocators, and hash maps in place of the ordered maps, for
+// runtime use only. Both kinds of map keep their elements in place, as
+// pointers to hypotheses and assertions are held. The hash maps allocate
+// from the memory resource given, such as an arena.
+struct HashedContainers
+{
+    template <class T>
+    using allocator = std::pmr::polymorphic_allocator<T>;
+
+    template <class T>
+    using namemap = std::pmr::unordered_map<std::pmr::string, T, NameHash,
+                                            NameEqual>;
+
+    std::pmr::memory_resource * resource;
+
+    template <class T>
+    namemap<T> makenamemap() const { return namemap<T>(resource); }
+};
+
+// A memory resource counting the allocations made from it, for profiling.
+// The verifier's containers allocate in the same way whichever the policy,
+// so this shows what drives the memory used in constant evaluation too.
+struct CountingResource : std::pmr::memory_resource
+{
+    std::pmr::memory_resource * upstream;
+    std::atomic<std::size_t> allocations;
+
+    explicit CountingResource(std::pmr::memory_resource * const resource)
+        : upstream(resource), allocations(0) { }
+
+    void * do_allocate(std::size_t const bytes,
+                       std::size_t const alignment) override
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void * const p, std::size_t const bytes,
+                       std::size_t const alignment) override
+    {
+        upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const & other)
+        const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+template <class Containers = OrderedContainers>
 struct checkmm
 {
 
-std::queue<std::string> tokens;
+template <class T>
+using namemap = typename Containers::template namemap<T>;
+
+// The containers of the database and of proofs, with the policy's allocator
+template <class T>
+using allocator = typename Containers::template allocator<T>;
+typedef std::basic_string<char, std::char_traits<char>, allocator<char> >
+    String;
+template <class T>
+using Vector = std::vector<T, allocator<T> >;
+template <class T>
+using Deque = std::deque<T, allocator<T> >;
+template <class T>
+using Set = std::set<T, std::less<T>, allocator<T> >;
+template <class Key, class T>
+using Map = std::map<Key, T, std::less<Key>,
+                     allocator<std::pair<Key const, T> > >;
+
+// The name maps are made by the container policy, which may give them a
+// memory resource to allocate from
+constexpr explicit checkmm(Containers const & containers = Containers())
+    : symbols(containers.template makenamemap<Symbol>()),
+      hypotheses(containers.template makenamemap<Hypothesis>()),
+      assertions(containers.template makenamemap<Assertion>())
+{ }
+
+// Math symbols (constants and variables) are interned as dense ids when they
+// are first declared, so an expression is an array of ids. Constants and
+// variables are numbered separately, and variable ids have variablebit set,
+// so whether a symbol is a constant is known from its id alone.
+typedef std::uint32_t Symbol;
+
+static constexpr Symbol variablebit = Symbol(1) << 31;
+static constexpr Symbol nosymbol = std::numeric_limits<Symbol>::max();
+
+namemap<Symbol> symbols;
+
+Symbol constantcount = 0;
+
+// Whether each variable is active, and the label of its active floating
+// hypothesis (or an empty string), by variable index. These are updated as
+// scopes are opened and closed, so lookups don't depend on how deeply they
+// are nested.
+Vector<bool> activevariables;
+Vector<String> floatinghyps;
+
+typedef Vector<Symbol> Expression;
+
+struct Hypothesis
+{
+    // Statement of the hypothesis
+    Expression expression;
+    // True iff the hypothesis is floating
+    bool floating;
+    // True iff the hypothesis is active, i.e. its block hasn't been closed
+    bool active;
+};
+
+namemap<Hypothesis> hypotheses;
+
+// A content hash, used to recognise proofs verified by an earlier run. The
+// symbols hashed are ids, not names; verification doesn't depend on names,
+// so it gives the same result for anything which hashes the same.
+typedef std::uint64_t Hash;
+
+static constexpr Hash hashbasis = 14695981039346656037ull;
+
+// Add a value to a hash, a byte at a time (FNV-1a)
+static constexpr Hash hashvalue(Hash hash, std::uint64_t const value)
+{
+    for (int i(0); i < 64; i += 8)
+    {
+        hash ^= (value >> i) & 0xff;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static constexpr Hash hashexpression(Hash hash, Expression const & exp)
+{
+    hash = hashvalue(hash, exp.size());
+    for (typename Expression::const_iterator iter(exp.begin()); iter != exp.end();
+         ++iter)
+    {
+        hash = hashvalue(hash, *iter);
+    }
+
+    return hash;
+}
+
+static constexpr Hash hashhypothesis(Hash hash, Hypothesis const & hyp)
+{
+    hash = hashvalue(hash, hyp.floating);
+    return hashexpression(hash, hyp.expression);
+}
+
+// A reference to an expression on the proof stack: a span of either the
+// statement of a hypothesis, or the arena holding the conclusions of proof
+// steps. It refers to the base expression by address and the span by
+// position, so it stays valid as the arena grows.
+struct ExpressionRef
+{
+    Expression const * base;
+    std::size_t first;
+    std::size_t last;
+
+    constexpr ExpressionRef() : base(nullptr), first(0), last(0) { }
 
-std::set<std::string> constants;
+    constexpr ExpressionRef
+        (Expression const & exp, std::size_t const f, std::size_t const l)
+        : base(&exp), first(f), last(l) { }
 
-typedef std::vector<std::string> Expression;
+    explicit constexpr ExpressionRef(Expression const & exp)
+        : base(&exp), first(0), last(exp.size()) { }
 
-// The first parameter is the statement of the hypothesis, the second is
-// true iff the hypothesis is floating.
-typedef std::pair<Expression, bool> Hypothesis;
+    constexpr std::size_t size() const { return last - first; }
 
-std::map<std::string, Hypothesis> hypotheses;
+    constexpr Symbol operator[](std::size_t const i) const
+    {
+        return (*base)[first + i];
+    }
 
-std::set<std::string> variables;
+    constexpr bool operator==(Expression const & exp) const
+    {
+        return size() == exp.size()
+            && std::equal(exp.begin(), exp.end(), base->begin() + first);
+    }
+};
 
 // An axiom or a theorem.
 struct Assertion
 {
     // Hypotheses of this axiom or theorem.
-    std::deque<std::string> hypotheses;
-    std::set<std::pair<std::string, std::string> > disjvars;
+    Deque<Hypothesis const *> hypotheses;
+    Set<std::pair<Symbol, Symbol> > disjvars;
     // Statement of axiom or theorem.
     Expression expression;
+    // Hash of the above, if there is a cache
+    Hash hash;
 };
 
-std::map<std::string, Assertion> assertions;
+namemap<Assertion> assertions;
 
 struct Scope
 {
-    std::set<std::string> activevariables;
+    Set<Symbol> activevariables;
     // Labels of active hypotheses
-    std::vector<std::string> activehyp;
-    std::vector<std::set<std::string> > disjvars;
+    Vector<String> activehyp;
+    // Pairs of variables first made disjoint in this scope
+    Vector<std::pair<Symbol, Symbol> > disjvars;
     // Map from variable to label of active floating hypothesis
-    std::map<std::string, std::string> floatinghyp;
+    Map<Symbol, String> floatinghyp;
+};
+
+Vector<Scope> scopes;
+
+// The active disjoint variable restrictions, as pairs of variables with the
+// lower id first. Updated as $d statements are read and scopes are closed.
+Set<std::pair<Symbol, Symbol> > disjvars;
+
+// A step of a proof, or a label of a compressed proof, resolved as the proof
+// is read: either a hypothesis or an assertion. Both are null for a "?" step.
+struct ProofStep
+{
+    Hypothesis const * hypothesis;
+    Assertion const * assertion;
+};
+
+// A proof to be verified. Everything verification needs is resolved by the
+// parser, so that a proof can be verified on another thread while the
+// parser reads on, and later statements change the parser's state.
+struct Proof
+{
+    String label;
+    Assertion const * theorem;
+    // The disjoint variable restrictions active for the theorem: the
+    // parser's own, if the proof is verified as it is read, or else a
+    // sorted copy, taken when it is queued for the pool
+    Set<std::pair<Symbol, Symbol> > const * activedisjvars;
+    Vector<std::pair<Symbol, Symbol> > disjvars;
+    bool compressed;
+    // The steps of a regular proof, or the labels of a compressed proof
+    Vector<ProofStep> steps;
+    // The numbers of a compressed proof
+    Vector<std::size_t> proofnumbers;
+    // Hash of all the above but the label, if there is a cache
+    Hash hash;
+
+    // Determine if there is a disjoint variable restriction on two
+    // different variables, for this theorem.
+    constexpr bool isdvr(Symbol const var1, Symbol const var2) const
+    {
+        if (var1 == var2)
+            return false;
+        std::pair<Symbol, Symbol> const dvpair
+            (var1 < var2 ? std::make_pair(var1, var2)
+                         : std::make_pair(var2, var1));
+        if (activedisjvars)
+            return activedisjvars->find(dvpair) != activedisjvars->end();
+        return std::binary_search(disjvars.begin(), disjvars.end(), dvpair);
+    }
+};
+
+// Set by defining CHECKMM_PROFILE, to count the work done by the verifier's
+// costliest functions, and report it at the end of a run
+#ifdef CHECKMM_PROFILE
+static constexpr bool profiling = true;
+#else
+static constexpr bool profiling = false;
+#endif
+
+// The work done by a function: the calls made to it, and the iterations of
+// its loops (or for reading tokens, the characters read). The counts are made identically in constant evaluation and at
+// runtime, so a runtime profile shows which function dominates the cost of
+// verifying a database at compile time.
+struct Cost
+{
+    std::size_t calls = 0;
+    std::size_t iterations = 0;
+
+    constexpr void call()
+    {
+        if (profiling)
+            ++calls;
+    }
+
+    constexpr void iterate(std::size_t const count = 1)
+    {
+        if (profiling)
+            iterations += count;
+    }
+
+    constexpr Cost & operator+=(Cost const & other)
+    {
+        calls += other.calls;
+        iterations += other.iterations;
+        return *this;
+    }
+};
+
+// The working storage used to verify proofs. Each thread verifying proofs
+// has its own.
+struct ProofContext
+{
+    // The work done verifying proofs, if profiling
+    Cost verifyproofcost;
+    Cost verifyassertionrefcost;
+
+    // The conclusions of the steps of the proof being verified. Proof stack
+    // entries and saved steps refer into this, so they are copied by
+    // reference rather than by value. It is cleared, but not freed, for
+    // each proof.
+    Expression arena;
+
+    // The substitution for each variable in the current proof step, by
+    // variable index: a span of a proof stack entry. Only the entries for
+    // the variables of the referenced assertion are set; the table is
+    // reused from step to step.
+    Vector<ExpressionRef> substitutions;
+
+    // Set if the proof last verified proves a statement other than its
+    // theorem's. That is reported, but isn't treated as a failure.
+    bool wrongstatement = false;
+};
+
+// Used to verify each proof as it is read, unless there is a pool
+ProofContext context;
+
+// Find the id of a math symbol, or nosymbol if it hasn't been declared.
+constexpr Symbol findsymbol(std::string_view const token) const
+{
+    typename namemap<Symbol>::const_iterator const loc
+        (symbols.find(token));
+    return loc != symbols.end() ? loc->second : nosymbol;
+}
+
+// Intern a newly declared math symbol, returning its id.
+constexpr Symbol addsymbol(std::string_view const token, bool const constant)
+{
+    Symbol sym;
+    if (constant)
+    {
+        sym = constantcount++;
+    }
+    else
+    {
+        sym = variablebit | activevariables.size();
+        activevariables.push_back(false);
+        floatinghyps.push_back(String());
+    }
+    symbols.insert(std::make_pair(std::string(token), sym));
+    return sym;
+}
+
+// Determine if a symbol (or nosymbol) is a constant.
+static constexpr bool isconstant(Symbol const sym)
+{
+    return !(sym & variablebit);
+}
+
+// Determine if a symbol (or nosymbol) is a variable.
+static constexpr bool isvariable(Symbol const sym)
+{
+    return sym != nosymbol && (sym & variablebit);
+}
+
+// The index of a variable, counting variables only
+static constexpr std::size_t variableindex(Symbol const var)
+{
+    return var & ~variablebit;
+}
+
+// Determine if a string is used as a label
+constexpr bool labelused(std::string_view const label)
+{
+    return hypotheses.find(label) != hypotheses.end()
+        || assertions.find(label) != assertions.end();
+}
+
+// Find active floating hypothesis corresponding to variable, or empty string
+// if there isn't one.
+constexpr String const & getfloatinghyp(Symbol const var) const
+{
+    return floatinghyps[variableindex(var)];
+}
+
+// Determine if a symbol is an active variable.
+constexpr bool isactivevariable(Symbol const sym) const
+{
+    return activevariables[variableindex(sym)];
+}
+
+// Determine if a string is the label of an active hypothesis.
+constexpr bool isactivehyp(std::string_view const str) const
+{
+    typename namemap<Hypothesis>::const_iterator const loc
+        (hypotheses.find(str));
+    return loc != hypotheses.end() && loc->second.active;
+}
+
+// Close the innermost scope, deactivating its variables and hypotheses.
+constexpr void endscope()
+{
+    Scope const & scope(scopes.back());
+
+    for (typename Set<Symbol>::const_iterator iter(scope.activevariables.begin());
+         iter != scope.activevariables.end(); ++iter)
+        activevariables[variableindex(*iter)] = false;
+
+    for (typename Vector<String>::const_iterator iter
+        (scope.activehyp.begin()); iter != scope.activehyp.end(); ++iter)
+        hypotheses.find(*iter)->second.active = false;
+
+    for (typename Map<Symbol, String>::const_iterator iter
+        (scope.floatinghyp.begin()); iter != scope.floatinghyp.end(); ++iter)
+        floatinghyps[variableindex(iter->first)].clear();
+
+    for (typename Vector<std::pair<Symbol, Symbol> >::const_iterator iter
+        (scope.disjvars.begin()); iter != scope.disjvars.end(); ++iter)
+        disjvars.erase(*iter);
+
+    scopes.pop_back();
+}
+
+// Determine if there is an active disjoint variable restriction on
+// two different variables.
+constexpr bool isdvr(Symbol const var1, Symbol const var2) const
+{
+    if (var1 == var2)
+        return false;
+    return disjvars.find(var1 < var2 ? std::make_pair(var1, var2)
+                                     : std::make_pair(var2, var1))
+        != disjvars.end();
+}
+
+// Determine if a character is white space in Metamath.
+static constexpr bool ismmws(char const ch)
+{
+    // This doesn't include \v ("vertical tab"), as the spec omits it.
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\f' || ch == '\r';
+}
+
+// The tokens the parser looks for, other than labels and math symbols
+enum TokenKind
+{
+    othertoken,
+    constanttoken,      // $c
+    variabletoken,      // $v
+    disjointtoken,      // $d
+    floatingtoken,      // $f
+    essentialtoken,     // $e
+    axiomtoken,         // $a
+    provabletoken,      // $p
+    prooftoken,         // $=
+    endtoken,           // $.
+    openscopetoken,     // ${
+    closescopetoken,    // $}
+    openparentoken,     // ( in a proof
+    closeparentoken,    // ) in a proof
+    unknownsteptoken    // ? in a proof
+};
+
+// What a token is, determined once as it is read, so that the parser
+// compares integers rather than strings.
+struct TokenClass
+{
+    TokenKind kind;
+    // True iff the token is a label token
+    bool label;
+    // True iff the token is a math symbol token
+    bool mathsymbol;
+    // True iff the token consists solely of upper-case letters or question
+    // marks, as the steps of a compressed proof do
+    bool upperorq;
+};
+
+// A token class packed in a byte, as stored in pre-tokenized files
+static constexpr std::uint8_t packtokenclass(TokenClass const tokenclass)
+{
+    return tokenclass.kind | tokenclass.label << 4
+         | tokenclass.mathsymbol << 5 | tokenclass.upperorq << 6;
+}
+
+static constexpr TokenClass unpacktokenclass(std::uint8_t const packed)
+{
+    return TokenClass{TokenKind(packed & 0xf), bool(packed & 1 << 4),
+                      bool(packed & 1 << 5), bool(packed & 1 << 6)};
+}
+
+// Classify a token.
+static constexpr TokenClass classifytoken(std::string_view const token)
+{
+    TokenClass tokenclass{othertoken, true, true, true};
+
+    for (std::string_view::const_iterator iter(token.begin());
+         iter != token.end(); ++iter)
+    {
+        unsigned char const ch(*iter);
+        if (!(std::isalnum(ch) || ch == '.' || ch == '-' || ch == '_'))
+            tokenclass.label = false;
+        if (ch == '$')
+            tokenclass.mathsymbol = false;
+        if (!std::isupper(ch) && ch != '?')
+            tokenclass.upperorq = false;
+    }
+
+    if (token.size() == 2 && token[0] == '$')
+    {
+        switch (token[1])
+        {
+        case 'c': tokenclass.kind = constanttoken; break;
+        case 'v': tokenclass.kind = variabletoken; break;
+        case 'd': tokenclass.kind = disjointtoken; break;
+        case 'f': tokenclass.kind = floatingtoken; break;
+        case 'e': tokenclass.kind = essentialtoken; break;
+        case 'a': tokenclass.kind = axiomtoken; break;
+        case 'p': tokenclass.kind = provabletoken; break;
+        case '=': tokenclass.kind = prooftoken; break;
+        case '.': tokenclass.kind = endtoken; break;
+        case '{': tokenclass.kind = openscopetoken; break;
+        case '}': tokenclass.kind = closescopetoken; break;
+        }
+    }
+    else if (token.size() == 1)
+    {
+        switch (token[0])
+        {
+        case '(': tokenclass.kind = openparentoken; break;
+        case ')': tokenclass.kind = closeparentoken; break;
+        case '?': tokenclass.kind = unknownsteptoken; break;
+        }
+    }
+
+    return tokenclass;
+}
+
+// Most runs of white space and tokens are short, so the scanners below
+// check this many characters one at a time before switching to vectors.
+static constexpr std::size_t scalarprefix = 16;
+
+// Return the position of the first character of text at or after pos which
+// isn't white space, or the end of the text (runtime only). Where the target
+// supports it, a vector of characters is compared at a time.
+static std::size_t skipwhitespace(std::string_view const text, std::size_t pos)
+{
+    char const * const data(text.data());
+    std::size_t const size(text.size());
+
+    for (std::size_t const stop(std::min(size, pos + scalarprefix));
+         pos < stop; ++pos)
+    {
+        if (!ismmws(data[pos]))
+            return pos;
+    }
+
+#if defined(__AVX2__)
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i const chars(_mm256_loadu_si256
+            (reinterpret_cast<__m256i const *>(data + pos)));
+        __m256i const ws(_mm256_or_si256
+            (_mm256_or_si256
+                (_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')),
+                 _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n'))),
+             _mm256_or_si256
+                (_mm256_or_si256
+                    (_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t')),
+                     _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\f'))),
+                 _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')))));
+        std::uint32_t const other(~std::uint32_t(_mm256_movemask_epi8(ws)));
+        if (other != 0)
+            return pos + std::countr_zero(other);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i const chars(_mm_loadu_si128
+            (reinterpret_cast<__m128i const *>(data + pos)));
+        __m128i const ws(_mm_or_si128
+            (_mm_or_si128
+                (_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')),
+                 _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'))),
+             _mm_or_si128
+                (_mm_or_si128
+                    (_mm_cmpeq_epi8(chars, _mm_set1_epi8('\t')),
+                     _mm_cmpeq_epi8(chars, _mm_set1_epi8('\f'))),
+                 _mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')))));
+        std::uint32_t const other(~std::uint32_t(_mm_movemask_epi8(ws))
+                                & 0xffff);
+        if (other != 0)
+            return pos + std::countr_zero(other);
+    }
+#endif
+
+    while (pos < size && ismmws(data[pos]))
+        ++pos;
+
+    return pos;
+}
+
+// Return the position of the first character of text at or after pos which
+// isn't printable, i.e. white space or an invalid character, or the end of
+// the text (runtime only). Printable characters are those from '!' to '~',
+// so as signed bytes they are greater than ' ' and less than 0x7f.
+static std::size_t skipprintable(std::string_view const text, std::size_t pos)
+{
+    char const * const data(text.data());
+    std::size_t const size(text.size());
+
+    for (std::size_t const stop(std::min(size, pos + scalarprefix));
+         pos < stop; ++pos)
+    {
+        if (data[pos] < '!' || data[pos] > '~')
+            return pos;
+    }
+
+#if defined(__AVX2__)
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i const chars(_mm256_loadu_si256
+            (reinterpret_cast<__m256i const *>(data + pos)));
+        __m256i const printable(_mm256_and_si256
+            (_mm256_cmpgt_epi8(chars, _mm256_set1_epi8(' ')),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), chars)));
+        std::uint32_t const other
+            (~std::uint32_t(_mm256_movemask_epi8(printable)));
+        if (other != 0)
+            return pos + std::countr_zero(other);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i const chars(_mm_loadu_si128
+            (reinterpret_cast<__m128i const *>(data + pos)));
+        __m128i const printable(_mm_and_si128
+            (_mm_cmpgt_epi8(chars, _mm_set1_epi8(' ')),
+             _mm_cmplt_epi8(chars, _mm_set1_epi8(0x7f))));
+        std::uint32_t const other
+            (~std::uint32_t(_mm_movemask_epi8(printable)) & 0xffff);
+        if (other != 0)
+            return pos + std::countr_zero(other);
+    }
+#endif
+
+    while (pos < size && data[pos] >= '!' && data[pos] <= '~')
+        ++pos;
+
+    return pos;
+}
+
+// Return the position of the first token of comment text at or after pos
+// which needs checking, or the end of the text (runtime only). Those are
+// the tokens containing a $, which may end the comment or be a stray $( or
+// $), and those containing an invalid character. Other tokens are skipped
+// without being read.
+static std::size_t skipcomment(std::string_view const text, std::size_t pos)
+{
+    char const * const data(text.data());
+    std::size_t const size(text.size());
+    std::size_t const start(pos);
+
+    // Each vector loop stops at the character found, if any, which the
+    // following loops then find straight away.
+#if defined(__AVX2__)
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i const chars(_mm256_loadu_si256
+            (reinterpret_cast<__m256i const *>(data + pos)));
+        __m256i const printable(_mm256_and_si256
+            (_mm256_cmpgt_epi8(chars, _mm256_set1_epi8(' ')),
+             _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), chars)));
+        __m256i const ws(_mm256_or_si256
+            (_mm256_or_si256
+                (_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')),
+                 _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n'))),
+             _mm256_or_si256
+                (_mm256_or_si256
+                    (_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t')),
+                     _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\f'))),
+                 _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')))));
+        __m256i const ordinary(_mm256_andnot_si256
+            (_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('$')),
+             _mm256_or_si256(printable, ws)));
+        std::uint32_t const other
+            (~std::uint32_t(_mm256_movemask_epi8(ordinary)));
+        if (other != 0)
+        {
+            pos += std::countr_zero(other);
+            break;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i const chars(_mm_loadu_si128
+            (reinterpret_cast<__m128i const *>(data + pos)));
+        __m128i const printable(_mm_and_si128
+            (_mm_cmpgt_epi8(chars, _mm_set1_epi8(' ')),
+             _mm_cmplt_epi8(chars, _mm_set1_epi8(0x7f))));
+        __m128i const ws(_mm_or_si128
+            (_mm_or_si128
+                (_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')),
+                 _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'))),
+             _mm_or_si128
+                (_mm_or_si128
+                    (_mm_cmpeq_epi8(chars, _mm_set1_epi8('\t')),
+                     _mm_cmpeq_epi8(chars, _mm_set1_epi8('\f'))),
+                 _mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')))));
+        __m128i const ordinary(_mm_andnot_si128
+            (_mm_cmpeq_epi8(chars, _mm_set1_epi8('$')),
+             _mm_or_si128(printable, ws)));
+        std::uint32_t const other
+            (~std::uint32_t(_mm_movemask_epi8(ordinary)) & 0xffff);
+        if (other != 0)
+        {
+            pos += std::countr_zero(other);
+            break;
+        }
+    }
+#endif
+
+    while (pos < size)
+    {
+        char const ch(data[pos]);
+        if (ch == '$' || ((ch < '!' || ch > '~') && !ismmws(ch)))
+            break;
+        ++pos;
+    }
+
+    if (pos == size)
+        return size;
+
+    // Back up to the start of the token
+    while (pos > start && !ismmws(data[pos - 1]))
+        --pos;
+
+    return pos;
+}
+
+// Read the next token of text, starting at pos, which is advanced past it.
+// Returns an empty token at the end of the text, or if an invalid character
+// is found; in the latter case pos is left before the end of the text.
+static constexpr std::string_view nexttoken(std::string_view const text,
+                                            std::size_t & pos)
+{
+    // Skip whitespace
+    if (!std::is_constant_evaluated())
+        pos = skipwhitespace(text, pos);
+    while (pos < text.size() && ismmws(text[pos]))
+        ++pos;
+
+    std::size_t const start(pos);
+
+    // Get token. At runtime the printable characters are skipped in bulk,
+    // and the loop below only checks the character which ended them.
+    if (!std::is_constant_evaluated())
+        pos = skipprintable(text, pos);
+    while (pos < text.size() && !ismmws(text[pos]))
+    {
+        char const ch(text[pos]);
+        if (ch < '!' || ch > '~')
+        {
+            std::cerr << "Invalid character read with code 0x";
+            std::cerr << std::hex << (unsigned int)(unsigned char)ch
+                      << std::endl;
+            return std::string_view();
+        }
+
+        ++pos;
+    }
+
+    return text.substr(start, pos - start);
+}
+
+// The size of the chunks of text lexed ahead on separate threads, when there
+// is more than one (runtime only). Chunks end at white space.
+static constexpr std::size_t lexchunksize = std::size_t(1) << 20;
+
+// A chunk of a source's text lexed ahead, and its tokens. Each chunk is
+// lexed as though it starts outside a comment. Lexing stops early at a token
+// which the sequential lexer must read: an unclosed comment, which may
+// continue into the next chunk, or anything that is an error.
+struct LexedChunk
+{
+    std::size_t begin;
+    std::size_t end;
+    // Where lexing stopped: end, or the start of the token to be read by the
+    // sequential lexer
+    std::size_t stop;
+    std::vector<std::string_view> tokens;
 };
 
-std::vector<Scope> scopes;
+// Lex a chunk of text (runtime only). This reports nothing, so that it can
+// run on any thread; the sequential lexer reports any error, on reaching
+// the place where lexing stopped.
+static void lexchunk(std::string_view const text, LexedChunk & chunk)
+{
+    // The scanners stop at the end of the chunk
+    std::string_view const part(text.substr(0, chunk.end));
+
+    std::size_t pos(chunk.begin);
+    for (;;)
+    {
+        pos = skipwhitespace(part, pos);
+        std::size_t const start(pos);
+        pos = skipprintable(part, pos);
+        if (start == part.size() || (pos != part.size() && !ismmws(part[pos])))
+        {
+            chunk.stop = start; // The end, or an invalid character
+            return;
+        }
+
+        std::string_view const token(part.substr(start, pos - start));
+        if (token != "$(")
+        {
+            chunk.tokens.push_back(token);
+            continue;
+        }
+
+        // Skip the comment, stopping at its start if it's not closed
+        for (;;)
+        {
+            std::size_t const tokenstart(skipcomment(part, pos));
+            pos = skipprintable(part, tokenstart);
+            if (tokenstart == part.size()
+             || (pos != part.size() && !ismmws(part[pos])))
+            {
+                chunk.stop = start;
+                return;
+            }
+
+            std::string_view const commenttoken
+                (part.substr(tokenstart, pos - tokenstart));
+            if (commenttoken == "$)")
+                break;
+            if (commenttoken.find("$(") != std::string_view::npos
+             || commenttoken.find("$)") != std::string_view::npos)
+            {
+                chunk.stop = start;
+                return;
+            }
+        }
+    }
+}
+
+// The layout of a pre-tokenized (.mmb) file, which holds the tokens of a
+// database file other than comments, so that it needn't be lexed again.
+// The header is followed by the offset of each distinct token (symbol) in
+// the string data, and the end of the last; the tokens, as symbol numbers;
+// the packed class of each symbol; and the string data. The file's size,
+// modification time and identity (device and inode) identify the file it
+// was made from; its text isn't hashed, as that would take about as long
+// as lexing it. Numbers are in the byte order of the machine which wrote it.
+struct PretokenizedHeader
+{
+    char magic[8];
+    std::uint64_t sourcesize;
+    std::int64_t sourcemtime;
+    std::int64_t sourcemtimensec;
+    std::uint64_t sourcedevice;
+    std::uint64_t sourceinode;
+    std::uint64_t symbolcount;
+    std::uint64_t tokencount;
+    std::uint64_t stringsize;
+};
+
+static constexpr char pretokenizedmagic[8]
+    = {'c', 'h', 'k', 'm', 'm', 'b', '2', '\0'};
+
+// The tokens of a database file, read from its pre-tokenized file
+struct Pretokenized
+{
+    std::uint32_t const * offsets;
+    std::uint32_t const * tokens;
+    std::uint8_t const * classes;
+    char const * strings;
+    std::size_t tokencount;
+
+    constexpr std::string_view symbol(std::uint32_t const id) const
+    {
+        return std::string_view(strings + offsets[id],
+                                offsets[id + 1] - offsets[id]);
+    }
+};
+
+// Write a file through a temporary file beside it, named uniquely, which is
+// renamed into place once it is complete. So the file is never seen partly
+// written, even by another run writing it at the same time. Returns true
+// iff okay (runtime only).
+static bool replacefile(std::string const & filename,
+                        std::string_view const contents)
+{
+    std::string tempfile(filename + ".XXXXXX");
+    int const fd(mkstemp(tempfile.data()));
+    if (fd < 0)
+        return false;
+
+    bool okay(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == 0);
+    for (std::size_t pos(0); okay && pos < contents.size(); )
+    {
+        ssize_t const count
+            (write(fd, contents.data() + pos, contents.size() - pos));
+        if (count < 0 && errno == EINTR)
+            continue;
+        okay = count > 0;
+        pos += okay ? count : 0;
+    }
+
+    okay = close(fd) == 0 && okay
+        && std::rename(tempfile.c_str(), filename.c_str()) == 0;
+    if (!okay)
+        std::remove(tempfile.c_str());
+
+    return okay;
+}
+
+// A read-only memory mapping of a database file. Tokens read from the file
+// are views into the mapping, so it is only released with the checkmm object.
+struct MappedFile
+{
+    void * addr;
+    std::size_t size;
+
+    constexpr MappedFile(void * const a, std::size_t const s)
+        : addr(a), size(s) { }
+    MappedFile(MappedFile const &) = delete;
+    MappedFile & operator=(MappedFile const &) = delete;
+    constexpr ~MappedFile() { munmap(addr, size); }
+};
+
+// The size of the buffer through which a database is read from standard
+// input. It only grows if a single token is longer.
+static constexpr std::size_t streambuffersize = std::size_t(1) << 20;
+
+// The compression of a database, from its first bytes. Text starting with
+// these bytes couldn't be a database, as they are invalid characters.
+enum Compression { uncompressed, gzipcompressed, zstdcompressed };
+
+static constexpr Compression compressionof(std::string_view const text)
+{
+    if (text.size() >= 2 && text[0] == '\x1f' && text[1] == '\x8b')
+        return gzipcompressed;
+    if (text.size() >= 4 && text.substr(0, 4) == "\x28\xb5\x2f\xfd")
+        return zstdcompressed;
+    return uncompressed;
+}
+
+// A database read through a buffer of bounded size: from a pipe, or a
+// compressed file, which is decompressed as it is read (runtime only). The
+// buffer holds the text from the current token on.
+struct StreamInput
+{
+    // The input is read from fd, if it isn't negative, which is closed with
+    // the input if it was opened for it
+    int fd = -1;
+    bool ownsfd = false;
+    std::vector<char> buffer;
+    std::size_t filled = 0;
+    bool eof = false;
+
+    // For compressed input: the compressed text not yet decompressed, the
+    // buffer it's read into from fd, and whether the end of the compressed
+    // text and of the last compressed stream (or frame) in it were reached
+    Compression compression = uncompressed;
+    std::string_view input;
+    std::vector<char> inputbuffer;
+    bool inputeof = false;
+    bool streamended = false;
+#ifdef CHECKMM_ZLIB
+    z_stream gzip{};
+    bool gzipstarted = false;
+#endif
+#ifdef CHECKMM_ZSTD
+    ZSTD_DStream * zstd = nullptr;
+#endif
+
+    StreamInput() = default;
+    StreamInput(StreamInput const &) = delete;
+    StreamInput & operator=(StreamInput const &) = delete;
+
+    ~StreamInput()
+    {
+        if (ownsfd)
+            close(fd);
+#ifdef CHECKMM_ZLIB
+        if (gzipstarted)
+            inflateEnd(&gzip);
+#endif
+#ifdef CHECKMM_ZSTD
+        ZSTD_freeDStream(zstd);
+#endif
+    }
+
+    // Start decompressing. Returns false if this build can't.
+    bool startdecompression()
+    {
+        switch (compression)
+        {
+        case gzipcompressed:
+#ifdef CHECKMM_ZLIB
+            // Expect a gzip header
+            gzipstarted = inflateInit2(&gzip, 16 + MAX_WBITS) == Z_OK;
+            return gzipstarted;
+#else
+            return false;
+#endif
+        case zstdcompressed:
+#ifdef CHECKMM_ZSTD
+            zstd = ZSTD_createDStream();
+            return zstd && !ZSTD_isError(ZSTD_initDStream(zstd));
+#else
+            return false;
+#endif
+        default:
+            return true;
+        }
+    }
+
+    // Read more compressed input, once the last has been used. Returns
+    // false if reading failed.
+    bool readinput()
+    {
+        if (fd < 0)
+        {
+            inputeof = true;
+            return true;
+        }
+
+        ssize_t count;
+        do
+        {
+            count = read(fd, inputbuffer.data(), inputbuffer.size());
+        } while (count < 0 && errno == EINTR);
+
+        if (count < 0)
+            return false;
+        if (count == 0)
+            inputeof = true;
+
+        input = std::string_view(inputbuffer.data(), count);
+        return true;
+    }
+
+    // Decompress into out, as much as there's space for. Returns the number
+    // of bytes produced, which is 0 only at the end of the input, or -1 if
+    // reading failed or the input is corrupt or truncated.
+    ssize_t decompress([[maybe_unused]] char * const out,
+                       [[maybe_unused]] std::size_t const space)
+    {
+        std::size_t produced(0);
+        while (produced == 0)
+        {
+            if (input.empty() && !inputeof && !readinput())
+                return -1;
+            if (input.empty() && inputeof)
+                return streamended ? 0 : -1;
+
+#ifdef CHECKMM_ZLIB
+            if (compression == gzipcompressed)
+            {
+                // Another gzip member may follow the last
+                if (streamended)
+                    inflateReset(&gzip);
+                gzip.next_in = reinterpret_cast<Bytef *>
+                    (const_cast<char *>(input.data()));
+                gzip.avail_in = input.size();
+                gzip.next_out = reinterpret_cast<Bytef *>(out);
+                gzip.avail_out = space;
+                int const result(inflate(&gzip, Z_NO_FLUSH));
+                if (result != Z_OK && result != Z_STREAM_END)
+                    return -1;
+                input.remove_prefix(input.size() - gzip.avail_in);
+                produced = space - gzip.avail_out;
+                streamended = result == Z_STREAM_END;
+            }
+#endif
+#ifdef CHECKMM_ZSTD
+            if (compression == zstdcompressed)
+            {
+                ZSTD_inBuffer in{input.data(), input.size(), 0};
+                ZSTD_outBuffer outbuffer{out, space, 0};
+                std::size_t const result
+                    (ZSTD_decompressStream(zstd, &outbuffer, &in));
+                if (ZSTD_isError(result))
+                    return -1;
+                input.remove_prefix(in.pos);
+                produced = outbuffer.pos;
+                streamended = result == 0;
+            }
+#endif
+        }
+
+        return produced;
+    }
+
+    // Read more text into the buffer, from space on. Returns as read does.
+    ssize_t readtext(std::size_t const space)
+    {
+        char * const out(buffer.data() + filled);
+        if (compression != uncompressed)
+            return decompress(out, space);
+
+        ssize_t count;
+        do
+        {
+            count = read(fd, out, space);
+        } while (count < 0 && errno == EINTR);
+
+        return count;
+    }
+};
+
+// The identity of a file, so that a file included by different paths (such
+// as a.mm and ./a.mm) is only read once
+typedef std::pair<dev_t, ino_t> FileId;
+
+// The size of the windows in which a mapped file is read ahead
+static constexpr std::size_t readaheadwindow = std::size_t(1) << 22;
+
+// Reads a mapped file into memory on a thread of its own, a window at a
+// time, so that reading the disk overlaps with lexing the text already read
+// (runtime only). The kernel is asked for the next window while the current
+// one is waited for, so two are in flight at once. If lexing overtakes the
+// reading, both simply wait for the same pages.
+struct ReadAhead
+{
+    char const * data;
+    std::size_t size;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    ReadAhead(void * const addr, std::size_t const s)
+        : data(static_cast<char const *>(addr)), size(s), stopping(false),
+          thread(&ReadAhead::work, this)
+    { }
+
+    ReadAhead(ReadAhead const &) = delete;
+    ReadAhead & operator=(ReadAhead const &) = delete;
+
+    ~ReadAhead()
+    {
+        stopping = true;
+        thread.join();
+    }
+
+    void advise(std::size_t const pos) const
+    {
+        if (pos < size)
+            madvise(const_cast<char *>(data) + pos,
+                    std::min(readaheadwindow, size - pos), MADV_WILLNEED);
+    }
+
+    void work()
+    {
+        long const pagesize(sysconf(_SC_PAGESIZE));
+        volatile char sink(0);
+
+        advise(0);
+        for (std::size_t pos(0); pos < size && !stopping;
+             pos += readaheadwindow)
+        {
+            std::size_t const next(pos + readaheadwindow);
+            advise(next);
+
+            std::size_t const end(std::min(next, size));
+            for (std::size_t page(pos); page < end; page += pagesize)
+                sink = sink + data[page];
+        }
+    }
+};
+
+// How far ahead of the lexer a file's text is searched for the names of
+// files it includes
+static constexpr std::size_t includescanwindow = std::size_t(1) << 20;
+
+// Maps the files named in file inclusion commands on a thread of its own, as
+// soon as their names are found, and reads them into memory, so that they
+// are ready by the time they are included (runtime only). The names are
+// found by a quick search of a file's text, a window ahead of the lexer,
+// which ignores comments, so a file may be loaded needlessly. Only regular
+// files are loaded, and opening them doesn't block, so that does no harm.
+struct IncludeLoader
+{
+    // A file loaded, or that could not be; it is then left to be opened
+    // as usual, which reports the error.
+    struct Loaded
+    {
+        bool okay;
+        FileId id;
+        void * addr;
+        std::size_t size;
+    };
+
+    std::mutex mutex;
+    std::condition_variable loadedone;
+
+    // The names of files to be loaded, in order
+    std::deque<std::string> queue;
+    bool finishing;
+
+    // Every name requested, and the files loaded but not yet taken
+    std::set<std::string> requested;
+    std::map<std::string, Loaded> loaded;
+
+    std::thread thread;
+
+    IncludeLoader() : finishing(false), thread(&IncludeLoader::work, this)
+    { }
+
+    ~IncludeLoader()
+    {
+        {
+            std::lock_guard<std::mutex> const lock(mutex);
+            finishing = true;
+        }
+        loadedone.notify_all();
+        thread.join();
+
+        for (typename std::map<std::string, Loaded>::const_iterator
+             iter(loaded.begin()); iter != loaded.end(); ++iter)
+        {
+            if (iter->second.addr)
+                munmap(iter->second.addr, iter->second.size);
+        }
+    }
+
+    // Queue a file to be loaded, unless it already has been
+    void request(std::string const & filename)
+    {
+        {
+            std::lock_guard<std::mutex> const lock(mutex);
+            if (!requested.insert(filename).second)
+                return;
+            queue.push_back(filename);
+        }
+        loadedone.notify_all();
+    }
+
+    // Take a file that was requested, waiting for it to be loaded. Returns
+    // false if it wasn't requested, or couldn't be loaded.
+    bool take(std::string const & filename, Loaded & file)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (requested.find(filename) == requested.end())
+            return false;
+
+        typename std::map<std::string, Loaded>::iterator iter;
+        while ((iter = loaded.find(filename)) == loaded.end())
+            loadedone.wait(lock);
+
+        file = iter->second;
+        iter->second.addr = nullptr; // It is the caller's now
+        return file.okay;
+    }
+
+    static Loaded load(std::string const & filename)
+    {
+        Loaded file{false, FileId(), nullptr, 0};
+
+        int const fd(open(filename.c_str(), O_RDONLY | O_NONBLOCK));
+        if (fd < 0)
+            return file;
+
+        // Anything else is left to be opened when it is included
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return file;
+        }
+        file.id = FileId(st.st_dev, st.st_ino);
+        file.size = st.st_size;
+
+        if (file.size != 0) // mmap rejects an empty mapping
+        {
+            void * const addr
+                (mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0));
+            if (addr == MAP_FAILED)
+            {
+                close(fd);
+                return file;
+            }
+            file.addr = addr;
+
+            // Bring the file into memory, a page at a time
+            madvise(addr, file.size, MADV_WILLNEED);
+            long const pagesize(sysconf(_SC_PAGESIZE));
+            char const * const data(static_cast<char const *>(addr));
+            volatile char sink(0);
+            for (std::size_t pos(0); pos < file.size; pos += pagesize)
+                sink = sink + data[pos];
+        }
+        close(fd);
+
+        file.okay = true;
+        return file;
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            while (!finishing && queue.empty())
+                loadedone.wait(lock);
+            if (finishing)
+                return;
+
+            std::string const filename(queue.front());
+            queue.pop_front();
+            lock.unlock();
+
+            Loaded const file(load(filename));
+
+            lock.lock();
+            loaded.insert(std::make_pair(filename, file));
+            loadedone.notify_all();
+        }
+    }
+};
+
+// The tokens of a database, produced on demand as the parser consumes them.
+// Parsing and verification thus proceed as the text is read, and only the
+// current token is held, rather than a queue of every token in the database.
+// Comments are skipped, and file inclusions followed, as they are reached.
+// Tokens are views into the text passed to run, the memory mapping of a
+// database file, or the buffer of a database read from standard input, and
+// remain valid until the next token is read.
+struct TokenStream
+{
+    // A file (or text) being read, and the position reached in it
+    struct Source
+    {
+        std::string filename;
+        std::string_view text;
+        std::size_t pos;
+        // The chunks of text lexed ahead at runtime, and the next of their
+        // tokens to be read
+        std::vector<LexedChunk> chunks;
+        std::size_t chunk;
+        std::size_t chunktoken;
+        // The tokens of the file, if they were read from its pre-tokenized
+        // file (runtime only), and the next of them to be read
+        Pretokenized pretokenized;
+        std::size_t pretoken;
+        // The input, if the text is read from standard input (runtime only)
+        StreamInput * stream;
+        // How far the text has been searched for file inclusion commands
+        // (runtime only)
+        std::size_t includescan;
+        // The length of the text discarded before text, if it is streamed
+        std::size_t offset;
+    };
+
+    // The innermost file inclusion is last
+    std::vector<Source> sources;
+
+    std::string_view token;
+    TokenClass tokenclass;
+    bool havetoken = false;
+
+    // Set if reading failed; the stream then appears empty.
+    bool failed = false;
+
+    // The work done reading tokens, if profiling: a call per file, and an
+    // iteration per character read, in comments and whitespace as well as
+    // tokens
+    Cost readtokenscost;
+
+    std::set<std::string> names;
+
+    // The identities of the files encountered (runtime only)
+    std::set<FileId> files;
+
+    std::deque<MappedFile> mappedfiles;
+
+    // Threads reading mapped files ahead of lexing, stopped before the files
+    // are unmapped (runtime only)
+    std::deque<ReadAhead> readaheads;
+
+    std::deque<StreamInput> streams;
+
+    // Loads included files ahead of their being read, once one is found
+    // (runtime only)
+    std::unique_ptr<IncludeLoader> loader;
+
+    // Lex ahead on this many threads, if more than one (runtime only)
+    unsigned lexthreads = 1;
+
+    // Read (and write) the tokens of each database file from a
+    // pre-tokenized file alongside it, named by adding ".mmb" (runtime only)
+    bool pretokenize = false;
+
+    // Stop the threads reading ahead, once reading is over. The verifier
+    // isn't destroyed at runtime, so this is done on every path out of run.
+    constexpr void stopreading()
+    {
+        if (!std::is_constant_evaluated())
+        {
+            readaheads.clear();
+            loader.reset();
+        }
+    }
+
+    constexpr bool empty() { return !next(); }
+
+    constexpr std::string_view front()
+    {
+        next();
+        return token;
+    }
+
+    constexpr TokenClass frontclass()
+    {
+        next();
+        return tokenclass;
+    }
+
+    constexpr TokenKind frontkind()
+    {
+        next();
+        return tokenclass.kind;
+    }
+
+    constexpr void pop()
+    {
+        next();
+        havetoken = false;
+    }
+
+    // Map a database file into memory (runtime only). The contents are
+    // returned through data. Returns true iff okay.
+    bool mapfile(std::string const & filename, std::string_view & data)
+    {
+        if (!mapregion(filename, data, true))
+            return false;
+
+        if (!data.empty())
+        {
+            void * const addr(const_cast<char *>(data.data()));
+            madvise(addr, data.size(), MADV_SEQUENTIAL);
+            mappedfiles.emplace_back(addr, data.size());
+        }
+
+        return true;
+    }
+
+    // Read a large mapped file from disk ahead of lexing it, on a thread of
+    // its own. This is only started once the file is known to be lexed, not
+    // read from its pre-tokenized file (runtime only).
+    void readahead(std::string_view const data)
+    {
+        if (data.size() > readaheadwindow)
+            readaheads.emplace_back(const_cast<char *>(data.data()),
+                                    data.size());
+    }
+
+    // Map a file into memory, without keeping the mapping: the caller
+    // releases it with munmap, if data isn't empty. Errors are reported only
+    // if report is set. Returns true iff okay (runtime only).
+    static bool mapregion(std::string const & filename,
+                          std::string_view & data, bool const report)
+    {
+        int const fd(open(filename.c_str(), O_RDONLY));
+        if (fd < 0)
+        {
+            if (report)
+                std::cerr << "Could not open " << filename << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            if (report)
+                std::cerr << "Error reading from " << filename << std::endl;
+            return false;
+        }
+
+        // Only a regular file's size is that of its contents
+        std::size_t const size(st.st_size);
+        if (S_ISREG(st.st_mode) && size == 0) // mmap rejects an empty mapping
+        {
+            close(fd);
+            data = std::string_view();
+            return true;
+        }
+
+        void * const addr(S_ISREG(st.st_mode)
+            ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            if (report)
+                std::cerr << "Could not map " << filename << std::endl;
+            return false;
+        }
+
+        data = std::string_view(static_cast<char const *>(addr), size);
+
+        return true;
+    }
+
+    // Fill in the header identifying a database file (runtime only)
+    static bool identifysource(std::string const & filename,
+                               std::string_view const text,
+                               PretokenizedHeader & header)
+    {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0)
+            return false;
+
+        std::memcpy(header.magic, pretokenizedmagic, sizeof header.magic);
+        header.sourcesize = text.size();
+        header.sourcemtime = st.st_mtim.tv_sec;
+        header.sourcemtimensec = st.st_mtim.tv_nsec;
+        header.sourcedevice = st.st_dev;
+        header.sourceinode = st.st_ino;
+
+        return true;
+    }
+
+    // Read the pre-tokenized file of a database file, if it matches. It is
+    // only kept mapped if it does. Returns true iff okay (runtime only).
+    bool readpretokenized(std::string const & filename,
+                          PretokenizedHeader const & source,
+                          Pretokenized & pretokenized)
+    {
+        std::string_view data;
+        if (!mapregion(filename, data, false))
+            return false;
+
+        void * const addr(const_cast<char *>(data.data()));
+        if (!checkpretokenized(data, source, pretokenized))
+        {
+            if (!data.empty())
+                munmap(addr, data.size());
+            return false;
+        }
+
+        madvise(addr, data.size(), MADV_SEQUENTIAL);
+        mappedfiles.emplace_back(addr, data.size());
+
+        return true;
+    }
+
+    // Check that a pre-tokenized file matches the database file, and is
+    // consistent, and find its parts (runtime only)
+    static bool checkpretokenized(std::string_view const data,
+                                  PretokenizedHeader const & source,
+                                  Pretokenized & pretokenized)
+    {
+        PretokenizedHeader header;
+        if (data.size() < sizeof header)
+            return false;
+        std::memcpy(&header, data.data(), sizeof header);
+        if (std::memcmp(header.magic, source.magic, sizeof header.magic) != 0
+         || header.sourcesize != source.sourcesize
+         || header.sourcemtime != source.sourcemtime
+         || header.sourcemtimensec != source.sourcemtimensec
+         || header.sourcedevice != source.sourcedevice
+         || header.sourceinode != source.sourceinode
+         || header.symbolcount >= std::numeric_limits<std::uint32_t>::max()
+         || header.tokencount > data.size() || header.stringsize > data.size()
+         || data.size() != sizeof header
+                         + 4 * (header.symbolcount + 1 + header.tokencount)
+                         + header.symbolcount + header.stringsize)
+        {
+            return false;
+        }
+
+        char const * const base(data.data() + sizeof header);
+        pretokenized.offsets = reinterpret_cast<std::uint32_t const *>(base);
+        pretokenized.tokens = pretokenized.offsets + header.symbolcount + 1;
+        pretokenized.classes = reinterpret_cast<std::uint8_t const *>
+            (pretokenized.tokens + header.tokencount);
+        pretokenized.strings = reinterpret_cast<char const *>
+            (pretokenized.classes + header.symbolcount);
+        pretokenized.tokencount = header.tokencount;
+
+        // Check every offset and token is in range
+        for (std::uint64_t i(0); i < header.symbolcount; ++i)
+        {
+            if (pretokenized.offsets[i] > pretokenized.offsets[i + 1])
+                return false;
+        }
+        if (pretokenized.offsets[header.symbolcount] != header.stringsize)
+            return false;
+        for (std::size_t i(0); i < pretokenized.tokencount; ++i)
+        {
+            if (pretokenized.tokens[i] >= header.symbolcount)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Write the pre-tokenized file of a database file, if it lexes without
+    // error; otherwise the lexer reports the error as it is read. It is
+    // written with replacefile, so it is never seen partly written.
+    // Returns true iff it was written (runtime only).
+    static bool writepretokenized(std::string const & filename,
+                                  std::string_view const text,
+                                  PretokenizedHeader header)
+    {
+        LexedChunk chunk{0, text.size(), 0, {}};
+        lexchunk(text, chunk);
+        if (chunk.stop != chunk.end)
+            return false;
+
+        std::unordered_map<std::string_view, std::uint32_t> ids;
+        std::vector<std::string_view> symbols;
+        std::vector<std::uint32_t> tokenids;
+        tokenids.reserve(chunk.tokens.size());
+        for (std::vector<std::string_view>::const_iterator
+             iter(chunk.tokens.begin()); iter != chunk.tokens.end(); ++iter)
+        {
+            std::pair<std::unordered_map<std::string_view, std::uint32_t>
+                ::iterator, bool> const id(ids.emplace(*iter, symbols.size()));
+            if (id.second)
+                symbols.push_back(*iter);
+            tokenids.push_back(id.first->second);
+        }
+
+        std::vector<std::uint32_t> offsets;
+        std::vector<std::uint8_t> classes;
+        std::string strings;
+        for (std::vector<std::string_view>::const_iterator
+             iter(symbols.begin()); iter != symbols.end(); ++iter)
+        {
+            offsets.push_back(strings.size());
+            classes.push_back(packtokenclass(classifytoken(*iter)));
+            strings += *iter;
+        }
+        offsets.push_back(strings.size());
+        if (strings.size() > std::numeric_limits<std::uint32_t>::max())
+            return false;
+
+        header.symbolcount = symbols.size();
+        header.tokencount = tokenids.size();
+        header.stringsize = strings.size();
+
+        std::string contents;
+        contents.append(reinterpret_cast<char const *>(&header),
+                        sizeof header);
+        contents.append(reinterpret_cast<char const *>(offsets.data()),
+                        4 * offsets.size());
+        contents.append(reinterpret_cast<char const *>(tokenids.data()),
+                        4 * tokenids.size());
+        contents.append(reinterpret_cast<char const *>(classes.data()),
+                        classes.size());
+        contents += strings;
+
+        return replacefile(filename, contents);
+    }
+
+    // Find the tokens of a database file in its pre-tokenized file, making
+    // that first if need be. The file's text is only read ahead, from the
+    // mapping given, if it is to be lexed. Returns true iff they were found
+    // (runtime only).
+    bool pretokenizedtokens(std::string const & filename,
+                            std::string_view const text,
+                            std::string_view const mapped,
+                            Pretokenized & pretokenized)
+    {
+        PretokenizedHeader source;
+        bool const identified(identifysource(filename, text, source));
+        std::string const mmbfile(filename + ".mmb");
+        if (identified && readpretokenized(mmbfile, source, pretokenized))
+            return true;
+
+        // The text is lexed now, to be written, or else as it is read
+        readahead(mapped);
+
+        return identified && writepretokenized(mmbfile, text, source)
+            && readpretokenized(mmbfile, source, pretokenized);
+    }
+
+    // Find the files named in file inclusion commands in the next window of
+    // a source's text, ahead of the lexer, and have them loaded ahead
+    // (runtime only). Comments are not skipped.
+    void loadincludes(Source & source)
+    {
+        std::string_view const text(source.text);
+        std::size_t const limit
+            (std::min(text.size(), source.pos + 2 * includescanwindow));
+        std::string_view const window(text.substr(0, limit));
+
+        // The next search starts a character early, in case a "$[" is split
+        // by the end of this window
+        std::size_t pos(source.includescan);
+        source.includescan = limit == text.size() ? limit : limit - 1;
+        for (pos = window.find("$[", pos); pos != std::string_view::npos;
+             pos = window.find("$[", pos + 2))
+        {
+            if ((pos != 0 && !ismmws(text[pos - 1]))
+             || pos + 2 == text.size() || !ismmws(text[pos + 2]))
+                continue;
+
+            std::size_t const start(skipwhitespace(text, pos + 2));
+            std::size_t const end(skipprintable(text, start));
+            if (start == end)
+                continue;
+
+            if (!loader)
+                loader.reset(new IncludeLoader());
+            loader->request(std::string(text.substr(start, end - start)));
+        }
+    }
+
+    // Map a database file, using the mapping made ahead if there is one;
+    // loadedahead is set if so, as it is then already in memory. Returns
+    // true iff okay (runtime only).
+    bool loadfile(std::string const & filename, std::string_view & data,
+                  bool & loadedahead)
+    {
+        typename IncludeLoader::Loaded file;
+        loadedahead = loader && loader->take(filename, file);
+        if (!loadedahead)
+            return mapfile(filename, data);
+
+        if (file.addr)
+        {
+            mappedfiles.emplace_back(file.addr, file.size);
+            madvise(file.addr, file.size, MADV_SEQUENTIAL);
+        }
+        data = std::string_view(static_cast<char const *>(file.addr),
+                                file.size);
+
+        return true;
+    }
+
+    // Read more of a streamed source into its buffer, discarding the text
+    // before source.pos, which becomes 0. Returns false at the end of the
+    // input, or if reading failed (runtime only).
+    bool refill(Source & source)
+    {
+        StreamInput & stream(*source.stream);
+        if (stream.eof)
+            return false;
+
+        std::vector<char> & buffer(stream.buffer);
+        std::copy(buffer.begin() + source.pos, buffer.begin() + stream.filled,
+                  buffer.begin());
+        stream.filled -= source.pos;
+        source.offset += source.pos;
+        source.pos = 0;
 
-// Determine if a string is used as a label
-constexpr bool labelused(std::string const label)
-{
-    return hypotheses.find(label) != hypotheses.end()
-        || assertions.find(label) != assertions.end();
-}
+        // Grow the buffer only if a token fills it
+        if (stream.filled == buffer.size())
+            buffer.resize(2 * buffer.size());
 
-// Find active floating hypothesis corresponding to variable, or empty string
-// if there isn't one.
-constexpr std::string getfloatinghyp(std::string const var)
-{
-    for (std::vector<Scope>::const_iterator iter(scopes.begin());
-         iter != scopes.end(); ++iter)
-    {
-        std::map<std::string, std::string>::const_iterator const loc
-            (iter->floatinghyp.find(var));
-        if (loc != iter->floatinghyp.end())
-            return loc->second;
-    }
+        ssize_t const count(stream.readtext(buffer.size() - stream.filled));
+        if (count < 0)
+        {
+            std::cerr << "Error reading from " << source.filename << std::endl;
+            failed = true;
+            stream.eof = true;
+            return false;
+        }
+        if (count == 0)
+            stream.eof = true;
 
-    return std::string();
-}
+        stream.filled += count;
+        source.text = std::string_view(buffer.data(), stream.filled);
 
-// Determine if a string is an active variable.
-constexpr bool isactivevariable(std::string const str)
-{
-    for (std::vector<Scope>::const_iterator iter(scopes.begin());
-         iter != scopes.end(); ++iter)
-    {
-        if (iter->activevariables.find(str) != iter->activevariables.end())
-            return true;
+        return true;
     }
-    return false;
-}
 
-// Determine if a string is the label of an active hypothesis.
-constexpr bool isactivehyp(std::string const str)
-{
-    for (std::vector<Scope>::const_iterator iter(scopes.begin());
-         iter != scopes.end(); ++iter)
+    // Make sure the next token of a streamed source, from source.pos, is
+    // wholly in its buffer (runtime only).
+    void filltoken(Source & source)
     {
-        if (std::find(iter->activehyp.begin(), iter->activehyp.end(), str)
-            != iter->activehyp.end())
-            return true;
+        for (;;)
+        {
+            source.pos = skipwhitespace(source.text, source.pos);
+            if (skipprintable(source.text, source.pos) < source.text.size()
+             || !refill(source))
+                return;
+        }
     }
-    return false;
-}
 
-// Determine if there is an active disjoint variable restriction on
-// two different variables.
-constexpr bool isdvr(std::string var1, std::string var2)
-{
-    if (var1 == var2)
-        return false;
-    for (std::vector<Scope>::const_iterator iter(scopes.begin());
-         iter != scopes.end(); ++iter)
+    // Skip the text of a comment in a streamed source, as skipcomment does,
+    // reading more as need be (runtime only).
+    void skipstreamcomment(Source & source)
     {
-        for (std::vector<std::set<std::string> >::const_iterator iter2
-            (iter->disjvars.begin()); iter2 != iter->disjvars.end(); ++iter2)
+        while ((source.pos = skipcomment(source.text, source.pos))
+            == source.text.size())
         {
-            if (   iter2->find(var1) != iter2->end()
-                && iter2->find(var2) != iter2->end())
-                return true;
+            // At the end of the input, the comment is unclosed
+            if (source.stream->eof)
+                return;
+
+            // Keep a token which may continue in the text still to be read
+            while (source.pos > 0 && !ismmws(source.text[source.pos - 1]))
+                --source.pos;
+            if (!refill(source))
+            {
+                source.pos = source.text.size();
+                return;
+            }
         }
     }
-    return false;
-}
-
-// Determine if a character is white space in Metamath.
-constexpr bool ismmws(char const ch)
-{
-    // This doesn't include \v ("vertical tab"), as the spec omits it.
-    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\f' || ch == '\r';
-}
 
-// Determine if a token is a label token.
-constexpr bool islabeltoken(std::string const token)
-{
-    for (std::string::const_iterator iter(token.begin()); iter != token.end();
-         ++iter)
+    // Start reading a database through a buffer: the compressed text of a
+    // file if it isn't empty, or else what is read from fd, which is then
+    // closed with the stream unless it is standard input. Compressed input is
+    // recognised, and decompressed as it is read. Returns true iff okay
+    // (runtime only).
+    bool openstream(std::string const & filename,
+                    std::string_view const compressed,
+                    std::string_view & data, StreamInput * & stream,
+                    int const fd = 0)
     {
-        unsigned char const ch(*iter);
-        if (!(std::isalnum(ch) || ch == '.' || ch == '-' || ch == '_'))
-            return false;
-    }
-    return true;
-}
+        streams.emplace_back();
+        stream = &streams.back();
+        stream->buffer.resize(streambuffersize);
 
-// Determine if a token is a math symbol token.
-constexpr bool ismathsymboltoken(std::string const token)
-{
-    return token.find('$') == std::string::npos;
-}
+        if (compressed.empty())
+        {
+            // Read enough of the input to recognise compression
+            stream->fd = fd;
+            stream->ownsfd = fd != 0;
+            while (stream->filled < 4)
+            {
+                ssize_t const count(stream->readtext(4 - stream->filled));
+                if (count < 0)
+                {
+                    std::cerr << "Error reading from " << filename
+                              << std::endl;
+                    return false;
+                }
+                if (count == 0)
+                {
+                    stream->eof = true;
+                    break;
+                }
+                stream->filled += count;
+            }
 
-// Determine if a token consists solely of upper-case letters or question marks
-constexpr bool containsonlyupperorq(std::string token)
-{
-    for (std::string::const_iterator iter(token.begin()); iter != token.end();
-         ++iter)
-    {
-        if (!std::isupper(*iter) && *iter != '?')
+            std::string_view const start
+                (stream->buffer.data(), stream->filled);
+            stream->compression = compressionof(start);
+            if (stream->compression != uncompressed)
+            {
+                // Decompress what was read, then the rest of the input
+                stream->inputbuffer.resize(1 << 16);
+                std::copy(start.begin(), start.end(),
+                          stream->inputbuffer.begin());
+                stream->input = std::string_view
+                    (stream->inputbuffer.data(), start.size());
+                stream->inputeof = stream->eof;
+                stream->filled = 0;
+                stream->eof = false;
+            }
+        }
+        else
+        {
+            stream->compression = compressionof(compressed);
+            stream->input = compressed;
+            stream->inputeof = true;
+        }
+
+        if (!stream->startdecompression())
+        {
+            std::cerr << filename << " is "
+                      << (stream->compression == gzipcompressed ? "gzip"
+                                                                : "zstd")
+                      << " compressed, which this build doesn't support"
+                      << std::endl;
             return false;
+        }
+
+        data = std::string_view(stream->buffer.data(), stream->filled);
+        return true;
     }
-    return true;
-}
 
-constexpr std::string nexttoken(std::istream & input)
-{
-    char ch;
-    std::string token;
+    // Start reading a file, or text if it isn't empty, before the rest of
+    // the current one. A filename of "-" is standard input; it, and any other
+    // file which isn't a regular file, such as a pipe, is read as a stream. A
+    // file already encountered, by any path, is ignored. Returns true iff
+    // okay.
+    constexpr bool readtokens
+        (std::string filename, std::string_view const text = {})
+    {
+        //static std::set<std::string> names;
 
-    // Skip whitespace
-    while (input.get(ch) && ismmws(ch)) { }
-    if (input.good())
-        input.unget();
+        readtokenscost.call();
 
-    // Get token
-    while (input.get(ch) && !ismmws(ch))
-    {
-        if (ch < '!' || ch > '~')
+        bool const alreadyencountered(!names.insert(filename).second);
+        if (alreadyencountered)
+            return true;
+
+        std::string_view data(text);
+        StreamInput * stream(nullptr);
+
+        // The mapping of a file which isn't already in memory, to be read
+        // ahead once it is known that its text is read
+        std::string_view mapped;
+
+        if (text.empty() && filename == "-")
         {
-            std::cerr << "Invalid character read with code 0x";
-            std::cerr << std::hex << (unsigned int)(unsigned char)ch
-                      << std::endl;
-            return std::string();
+            bool const okay(openstream(filename, "", data, stream));
+            if (!okay)
+                return false;
         }
+        else if (text.empty())
+        {
+            struct stat st;
+            bool const found(stat(filename.c_str(), &st) == 0);
+            if (found && !files.insert(FileId(st.st_dev, st.st_ino)).second)
+                return true;
 
-        token += ch;
-    }
+            if (found && !S_ISREG(st.st_mode))
+            {
+                int const fd(open(filename.c_str(), O_RDONLY));
+                if (fd < 0)
+                {
+                    std::cerr << "Could not open " << filename << std::endl;
+                    return false;
+                }
 
-    if (!input.eof() && input.fail())
-        return std::string();
+                bool const okay(openstream(filename, "", data, stream, fd));
+                if (!okay)
+                    return false;
+            }
+            else
+            {
+                bool loadedahead;
+                bool okay(loadfile(filename, data, loadedahead));
+                if (!okay)
+                    return false;
+                if (!loadedahead)
+                    mapped = data;
 
-    return token;
-}
+                if (compressionof(data) != uncompressed)
+                {
+                    readahead(mapped);
+                    okay = openstream(filename, data, data, stream);
+                    if (!okay)
+                        return false;
+                }
+            }
+        }
 
-std::set<std::string> names;
+        Pretokenized pretokenized{};
+        if (pretokenize && text.empty() && !stream)
+            pretokenizedtokens(filename, data, mapped, pretokenized);
+        else if (!stream && !mapped.empty())
+            readahead(mapped);
 
-constexpr bool readtokens(std::string filename, std::string const &text = "")
-{
-    //static std::set<std::string> names;
+        sources.push_back
+            (Source{filename, data, 0, {}, 0, 0, pretokenized, 0, stream, 0, 0});
 
-    bool const alreadyencountered(!names.insert(filename).second);
-    if (alreadyencountered)
         return true;
+    }
+
+    // Read the next token of a comment which needs checking. At runtime, the
+    // tokens before it are skipped in bulk.
+    constexpr std::string_view readcommenttoken(Source & source)
+    {
+        if (source.stream)
+        {
+            skipstreamcomment(source);
+            filltoken(source);
+        }
+        else if (!std::is_constant_evaluated())
+            source.pos = skipcomment(source.text, source.pos);
 
-    std::istringstream in;
+        return nexttoken(source.text, source.pos);
+    }
 
-    if (!text.empty())
+    // Read the next token of a source's text, reading more of a streamed
+    // source first if need be.
+    constexpr std::string_view readtexttoken(Source & source)
     {
-        in.str(text);
+        if (source.stream)
+            filltoken(source);
+
+        return nexttoken(source.text, source.pos);
     }
-    else
+
+    // Lex the next chunks of a source, one per thread (runtime only).
+    void lexahead(Source & source)
     {
-        std::ifstream file(filename.c_str());
-        if (!file)
+        source.chunks.assign(lexthreads, LexedChunk());
+        source.chunk = 0;
+        source.chunktoken = 0;
+
+        std::size_t begin(source.pos);
+        for (typename std::vector<LexedChunk>::iterator
+             iter(source.chunks.begin()); iter != source.chunks.end(); ++iter)
         {
-            std::cerr << "Could not open " << filename << std::endl;
-            return false;
+            std::size_t end
+                (std::min(source.text.size(), begin + lexchunksize));
+            while (end < source.text.size() && !ismmws(source.text[end]))
+                ++end;
+
+            iter->begin = begin;
+            iter->end = end;
+            begin = end;
         }
-        std::string str((std::istreambuf_iterator(file)), {});
-        in.str(str);
-    }
 
-    bool incomment(false);
-    bool infileinclusion(false);
-    std::string newfilename;
+        std::vector<std::thread> threads;
+        for (typename std::vector<LexedChunk>::iterator
+             iter(source.chunks.begin() + 1); iter != source.chunks.end();
+             ++iter)
+        {
+            threads.emplace_back(lexchunk, source.text, std::ref(*iter));
+        }
 
-    std::string token;
-    while (!(token = nexttoken(in)).empty())
+        lexchunk(source.text, source.chunks.front());
+
+        for (std::vector<std::thread>::iterator iter(threads.begin());
+             iter != threads.end(); ++iter)
+        {
+            iter->join();
+        }
+    }
+
+    // Read the next token of a source lexed ahead (runtime only). Returns
+    // false if the sequential lexer must read it, from source.pos.
+    bool readlexedtoken(Source & source, std::string_view & token)
     {
-        if (incomment)
+        for (;;)
         {
-            if (token == "$)")
+            if (source.chunk == source.chunks.size())
             {
-                incomment = false;
-                continue;
+                // Lex ahead, if there is enough text left to be worth it
+                if (source.text.size() - source.pos < 2 * lexchunksize)
+                    return false;
+                lexahead(source);
             }
-            if (token.find("$(") != std::string::npos)
+
+            LexedChunk const & chunk(source.chunks[source.chunk]);
+            if (source.chunktoken < chunk.tokens.size())
             {
-                std::cerr << "Characters $( found in a comment" << std::endl;
-                return false;
+                token = chunk.tokens[source.chunktoken++];
+                source.pos = token.data() + token.size() - source.text.data();
+                return true;
             }
-            if (token.find("$)") != std::string::npos)
+
+            if (chunk.stop != chunk.end)
             {
-                std::cerr << "Characters $) found in a comment" << std::endl;
+                source.pos = chunk.stop;
                 return false;
             }
-            continue;
+
+            ++source.chunk;
+            source.chunktoken = 0;
         }
+    }
 
-        // Not in comment
-        if (token == "$(")
+    // Continue with the tokens lexed ahead after the sequential lexer has
+    // read a token (runtime only). Any chunk it read into, other than the
+    // one it started in, is still good from where it stopped reading: the
+    // text before that was in a comment, so couldn't have started one.
+    void resumelexedtokens(Source & source)
+    {
+        for (++source.chunk; source.chunk < source.chunks.size();
+             ++source.chunk)
         {
-            incomment = true;
-            continue;
+            LexedChunk const & chunk(source.chunks[source.chunk]);
+            if (source.pos > chunk.end)
+                continue;
+
+            if (source.pos > chunk.stop)
+                break;
+
+            char const * const next(source.text.data() + source.pos);
+            source.chunktoken = std::lower_bound
+                (chunk.tokens.begin(), chunk.tokens.end(), next,
+                 [](std::string_view const & token, char const * const pos)
+                 { return token.data() < pos; }) - chunk.tokens.begin();
+            return;
+        }
+
+        // Lex ahead again from here
+        source.chunks.clear();
+        source.chunk = 0;
+        source.chunktoken = 0;
+    }
+
+    // Read the next token of a source, skipping comments. Returns an empty
+    // token at the end of the source, or if reading failed.
+    constexpr std::string_view readtoken(Source & source)
+    {
+        if (source.pretokenized.tokens)
+        {
+            if (source.pretoken == source.pretokenized.tokencount)
+                return std::string_view();
+
+            return source.pretokenized.symbol
+                (source.pretokenized.tokens[source.pretoken++]);
+        }
+
+        if (!std::is_constant_evaluated() && !source.stream
+         && source.includescan < source.pos + includescanwindow
+         && source.includescan < source.text.size())
+            loadincludes(source);
+
+        if (!std::is_constant_evaluated() && lexthreads > 1
+         && !source.stream)
+        {
+            std::string_view token;
+            if (readlexedtoken(source, token))
+                return token;
+
+            token = scantoken(source);
+            resumelexedtokens(source);
+            return token;
         }
 
-        if (infileinclusion)
+        return scantoken(source);
+    }
+
+    // Read the next token of a source, skipping comments, by scanning the
+    // text from source.pos.
+    constexpr std::string_view scantoken(Source & source)
+    {
+        std::string_view token;
+        while (!(token = readtexttoken(source)).empty())
         {
-            if (newfilename.empty())
+            if (token != "$(")
+                return token;
+
+            // Skip the comment
+            while (!(token = readcommenttoken(source)).empty()
+                && token != "$)")
             {
-                if (token.find('$') != std::string::npos)
+                if (token.find("$(") != std::string_view::npos)
                 {
-                    std::cerr << "Filename " << token << " contains a $"
+                    std::cerr << "Characters $( found in a comment"
                               << std::endl;
-                    return false;
+                    failed = true;
+                    return std::string_view();
                 }
-                newfilename = token;
-                continue;
-            }
-            else
-            {
-                if (token != "$]")
+                if (token.find("$)") != std::string_view::npos)
                 {
-                    std::cerr << "Didn't find closing file inclusion delimiter"
+                    std::cerr << "Characters $) found in a comment"
                               << std::endl;
-                    return false;
+                    failed = true;
+                    return std::string_view();
                 }
+            }
 
-                bool const okay(readtokens(newfilename));
-                if (!okay)
-                    return false;
-                infileinclusion = false;
-                newfilename.clear();
-                continue;
+            if (token.empty())
+            {
+                // Unless reading failed, which was reported
+                if (source.pos == source.text.size() && !failed)
+                    std::cerr << "Unclosed comment" << std::endl;
+                failed = true;
+                return std::string_view();
             }
         }
 
-        if (token == "$[")
+        if (source.pos != source.text.size()) // An invalid character
+            failed = true;
+
+        return std::string_view();
+    }
+
+    // Classify the token last read from a source
+    constexpr TokenClass classify
+        (Source const & source, std::string_view const token) const
+    {
+        if (source.pretokenized.tokens)
+        {
+            return unpacktokenclass(source.pretokenized.classes
+                [source.pretokenized.tokens[source.pretoken - 1]]);
+        }
+
+        return classifytoken(token);
+    }
+
+    // Make the next token current, if there is one. Returns false at the end
+    // of the database, or if reading failed.
+    constexpr bool next()
+    {
+        while (!havetoken && !failed && !sources.empty())
         {
+            Source & source(sources.back());
+            std::size_t const start(source.offset + source.pos);
+            std::string_view const newtoken(readtoken(source));
+            readtokenscost.iterate(source.offset + source.pos - start);
+            if (failed)
+                break;
+
+            if (newtoken.empty())
+            {
+                sources.pop_back(); // End of this file
+                continue;
+            }
+
+            if (newtoken != "$[")
+            {
+                token = newtoken;
+                tokenclass = classify(sources.back(), newtoken);
+                havetoken = true;
+                break;
+            }
+
             if (std::is_constant_evaluated()) {
               throw std::runtime_error("File inclusion unsupported within constexpr evaluation.");
             }
-            infileinclusion = true;
-            continue;
+
+            // Copied, as reading the next token may move the text
+            std::string const newfilename(readtoken(sources.back()));
+            if (failed)
+                break;
+
+            if (newfilename.find('$') != std::string::npos)
+            {
+                std::cerr << "Filename " << newfilename << " contains a $"
+                          << std::endl;
+                failed = true;
+                break;
+            }
+
+            std::string_view const closing(readtoken(sources.back()));
+            if (failed)
+                break;
+
+            if (newfilename.empty() || closing.empty())
+            {
+                std::cerr << "Unfinished file inclusion command" << std::endl;
+                failed = true;
+                break;
+            }
+
+            if (closing != "$]")
+            {
+                std::cerr << "Didn't find closing file inclusion delimiter"
+                          << std::endl;
+                failed = true;
+                break;
+            }
+
+            bool const okay(readtokens(newfilename));
+            if (!okay)
+                failed = true;
         }
 
-        tokens.push(token);
-    }
+        if (failed)
+            sources.clear();
 
-    if (!in.eof())
-    {
-        if (in.fail())
-            std::cerr << "Error reading from " << filename << std::endl;
-        return false;
+        return havetoken;
     }
+};
+
+TokenStream tokens;
 
-    if (incomment)
+// Hash an assertion: its statement and its frame.
+static constexpr Hash hashassertion(Assertion const & assertion)
+{
+    Hash hash(hashvalue(hashbasis, assertion.hypotheses.size()));
+    for (typename Deque<Hypothesis const *>::const_iterator
+         iter(assertion.hypotheses.begin());
+         iter != assertion.hypotheses.end(); ++iter)
     {
-        std::cerr << "Unclosed comment" << std::endl;
-        return false;
+        hash = hashhypothesis(hash, **iter);
     }
 
-    if (infileinclusion)
+    hash = hashvalue(hash, assertion.disjvars.size());
+    for (typename Set<std::pair<Symbol, Symbol> >::const_iterator
+         iter(assertion.disjvars.begin()); iter != assertion.disjvars.end();
+         ++iter)
     {
-        std::cerr << "Unfinished file inclusion command" << std::endl;
-        return false;
+        hash = hashvalue(hash, iter->first);
+        hash = hashvalue(hash, iter->second);
     }
 
-    return true;
+    return hashexpression(hash, assertion.expression);
 }
 
+// The work done constructing assertions, if profiling
+Cost constructassertioncost;
+
 // Construct an Assertion from an Expression. That is, determine the
 // mandatory hypotheses and disjoint variable restrictions.
 // The Assertion is inserted into the assertions collection,
@@ -352,43 +2408,49 @@ constexpr bool readtokens(std::string filename, std::string const &text = "")
 constexpr Assertion & constructassertion
   (std::string const label, Expression const & exp)
 {
+    constructassertioncost.call();
+
     Assertion & assertion
         (assertions.insert(std::make_pair(label, Assertion())).first->second);
 
     assertion.expression = exp;
 
-    std::set<std::string> varsused;
+    Set<Symbol> varsused;
 
     // Determine variables used and find mandatory hypotheses
 
-    for (Expression::const_iterator iter(exp.begin()); iter != exp.end();
+    for (typename Expression::const_iterator iter(exp.begin()); iter != exp.end();
          ++iter)
     {
-        if (variables.find(*iter) != variables.end())
+        constructassertioncost.iterate();
+        if (isvariable(*iter))
             varsused.insert(*iter);
     }
 
-    for (std::vector<Scope>::const_reverse_iterator iter(scopes.rbegin());
-         iter != scopes.rend(); ++iter)
+    for (typename Vector<Scope>::const_reverse_iterator
+         iter(scopes.rbegin()); iter != scopes.rend(); ++iter)
     {
-        std::vector<std::string> const & hypvec(iter->activehyp);
-        for (std::vector<std::string>::const_reverse_iterator iter2
+        Vector<String> const & hypvec(iter->activehyp);
+        for (typename Vector<String>::const_reverse_iterator iter2
             (hypvec.rbegin()); iter2 != hypvec.rend(); ++iter2)
         {
+            constructassertioncost.iterate();
             Hypothesis const & hyp(hypotheses.find(*iter2)->second);
-            if (hyp.second && varsused.find(hyp.first[1]) != varsused.end())
+            if (hyp.floating
+             && varsused.find(hyp.expression[1]) != varsused.end())
             {
                 // Mandatory floating hypothesis
-                assertion.hypotheses.push_front(*iter2);
+                assertion.hypotheses.push_front(&hyp);
             }
-            else if (!hyp.second)
+            else if (!hyp.floating)
             {
                 // Essential hypothesis
-                assertion.hypotheses.push_front(*iter2);
-                for (Expression::const_iterator iter3(hyp.first.begin());
-                     iter3 != hyp.first.end(); ++iter3)
+                assertion.hypotheses.push_front(&hyp);
+                for (typename Expression::const_iterator iter3(hyp.expression.begin());
+                     iter3 != hyp.expression.end(); ++iter3)
                 {
-                    if (variables.find(*iter3) != variables.end())
+                    constructassertioncost.iterate();
+                    if (isvariable(*iter3))
                         varsused.insert(*iter3);
                 }
             }
@@ -396,36 +2458,28 @@ constexpr Assertion & constructassertion
     }
 
     // Determine mandatory disjoint variable restrictions
-    for (std::vector<Scope>::const_iterator iter(scopes.begin());
-         iter != scopes.end(); ++iter)
+    for (typename Set<Symbol>::const_iterator iter(varsused.begin());
+         iter != varsused.end(); ++iter)
     {
-        std::vector<std::set<std::string> > const & disjvars(iter->disjvars);
-        for (std::vector<std::set<std::string> >::const_iterator iter2
-            (disjvars.begin()); iter2 != disjvars.end(); ++iter2)
+        typename Set<Symbol>::const_iterator iter2(iter);
+        ++iter2;
+        for (; iter2 != varsused.end(); ++iter2)
         {
-            std::set<std::string> dset;
-            std::set_intersection
-                 (iter2->begin(), iter2->end(),
-                  varsused.begin(), varsused.end(),
-                  std::inserter(dset, dset.end()));
-
-            for (std::set<std::string>::const_iterator diter(dset.begin());
-                 diter != dset.end(); ++diter)
-            {
-                std::set<std::string>::const_iterator diter2(diter);
-                ++diter2;
-                for (; diter2 != dset.end(); ++diter2)
-                    assertion.disjvars.insert(std::make_pair(*diter, *diter2));
-            }
+            constructassertioncost.iterate();
+            if (isdvr(*iter, *iter2))
+                assertion.disjvars.insert(std::make_pair(*iter, *iter2));
         }
     }
 
+    if (!cachefile.empty())
+        assertion.hash = hashassertion(assertion);
+
     return assertion;
 }
 
 // Read an expression from the token stream. Returns true iff okay.
 constexpr bool readexpression
-    ( char stattype, std::string label, std::string terminator,
+    ( char stattype, std::string label, TokenKind terminator,
       Expression * exp)
 {
     if (tokens.empty())
@@ -437,7 +2491,8 @@ constexpr bool readexpression
 
     std::string type(tokens.front());
 
-    if (constants.find(type) == constants.end())
+    Symbol const typesym(findsymbol(type));
+    if (!isconstant(typesym))
     {
         std::cerr << "First symbol in $" << stattype << " statement " << label
                   << " is " << type << " which is not a constant" << std::endl;
@@ -446,16 +2501,18 @@ constexpr bool readexpression
 
     tokens.pop();
 
-    exp->push_back(type);
+    exp->push_back(typesym);
 
     std::string token;
 
-    while (!tokens.empty() && (token = tokens.front()) != terminator)
+    while (!tokens.empty() && tokens.frontkind() != terminator)
     {
+        token = tokens.front();
         tokens.pop();
 
-        if (constants.find(token) == constants.end()
-         && getfloatinghyp(token).empty())
+        Symbol const sym(findsymbol(token));
+        if (!isconstant(sym)
+         && (sym == nosymbol || getfloatinghyp(sym).empty()))
         {
             std::cerr << "In $" << stattype << " statement " << label
                       << " token " << token
@@ -464,7 +2521,7 @@ constexpr bool readexpression
             return false;
         }
 
-        exp->push_back(token);
+        exp->push_back(sym);
     }
 
     if (tokens.empty())
@@ -479,36 +2536,84 @@ constexpr bool readexpression
     return true;
 }
 
-// Make a substitution of variables. The result is put in "destination",
-// which should be empty.
-constexpr void makesubstitution
-    (Expression const & original, std::map<std::string, Expression> substmap,
-     Expression * destination
-    )
+// Make a substitution of variables, from the substitutions table. The result
+// is appended to the arena, and a reference to it is returned.
+constexpr ExpressionRef makesubstitution
+    (Expression const & original, ProofContext & context) const
+{
+    Expression & arena(context.arena);
+    std::size_t const first(arena.size());
+    Cost & cost(context.verifyassertionrefcost);
+
+    for (typename Expression::const_iterator iter(original.begin());
+         iter != original.end(); ++iter)
+    {
+        if (isconstant(*iter))
+        {
+            // Constant
+            cost.iterate();
+            arena.push_back(*iter);
+        }
+        else
+        {
+            // Variable. The substitution may itself be in the arena, so it
+            // is read by position as the arena grows.
+            ExpressionRef const & subst
+                (context.substitutions[variableindex(*iter)]);
+            for (std::size_t i(0); i < subst.size(); ++i)
+            {
+                Symbol const sym(subst[i]);
+                cost.iterate();
+                arena.push_back(sym);
+            }
+        }
+    }
+
+    return ExpressionRef(arena, first, arena.size());
+}
+
+// Determine if making a substitution of variables, from the substitutions
+// table, gives "target". The substituted expression isn't built; the
+// comparison stops at the first mismatch.
+constexpr bool matchessubstitution
+    (Expression const & original, ExpressionRef const & target,
+     ProofContext & context) const
 {
-    for (Expression::const_iterator iter(original.begin());
+    std::size_t pos(0);
+
+    for (typename Expression::const_iterator iter(original.begin());
          iter != original.end(); ++iter)
     {
-        std::map<std::string, Expression>::const_iterator const iter2
-            (substmap.find(*iter));
-        if (iter2 == substmap.end())
+        context.verifyassertionrefcost.iterate();
+        if (isconstant(*iter))
         {
             // Constant
-            destination->push_back(*iter);
+            if (pos == target.size() || target[pos] != *iter)
+                return false;
+            ++pos;
         }
         else
         {
             // Variable
-            std::copy(iter2->second.begin(), iter2->second.end(),
-                      std::back_inserter(*destination));
+            ExpressionRef const & subst
+                (context.substitutions[variableindex(*iter)]);
+            if (target.size() - pos < subst.size())
+                return false;
+            for (std::size_t i(0); i < subst.size(); ++i, ++pos)
+            {
+                if (target[pos] != subst[i])
+                    return false;
+            }
         }
     }
+
+    return pos == target.size();
 }
 
 // Get the raw numbers from compressed proof format.
 // The letter Z is translated as 0.
 constexpr bool getproofnumbers(std::string label, std::string proof,
-                               std::vector<std::size_t> * proofnumbers)
+                               Vector<std::size_t> * proofnumbers)
 {
     std::size_t const size_max(std::numeric_limits<std::size_t>::max());
 
@@ -573,146 +2678,136 @@ constexpr bool getproofnumbers(std::string label, std::string proof,
 // Subroutine for proof verification. Verify a proof step referencing an
 // assertion (i.e., not a hypothesis).
 constexpr bool verifyassertionref
-  (std::string thlabel, std::string reflabel, std::vector<Expression> * stack)
+  (Proof const & proof, Assertion const & assertion,
+   Vector<ExpressionRef> * stack, ProofContext & context,
+   std::ostream & err) const
 {
-    Assertion const & assertion(assertions.find(reflabel)->second);
+    Cost & cost(context.verifyassertionrefcost);
+    cost.call();
+
     if (stack->size() < assertion.hypotheses.size())
     {
-        std::cerr << "In proof of theorem " << thlabel
-                  << " not enough items found on stack" << std::endl;
+        err << "In proof of theorem " << proof.label
+            << " not enough items found on stack" << std::endl;
         return false;
     }
 
-    std::vector<Expression>::size_type const base
+    typename Vector<ExpressionRef>::size_type const base
         (stack->size() - assertion.hypotheses.size());
 
-    std::map<std::string, Expression> substitutions;
-
     // Determine substitutions and check that we can unify
-    for (std::deque<std::string>::size_type i(0);
+    for (typename Deque<Hypothesis const *>::size_type i(0);
          i < assertion.hypotheses.size(); ++i)
     {
-        Hypothesis const & hypothesis
-            (hypotheses.find(assertion.hypotheses[i])->second);
-        if (hypothesis.second)
+        cost.iterate();
+        Hypothesis const & hypothesis(*assertion.hypotheses[i]);
+        ExpressionRef const & entry((*stack)[base + i]);
+        if (hypothesis.floating)
         {
             // Floating hypothesis of the referenced assertion
-            if (hypothesis.first[0] != (*stack)[base + i][0])
+            if (hypothesis.expression[0] != entry[0])
             {
-                std::cout << "In proof of theorem " << thlabel
-                          << " unification failed" << std::endl;
+                err << "In proof of theorem " << proof.label
+                    << " unification failed" << std::endl;
                 return false;
             }
-            Expression & subst(substitutions.insert
-                (std::make_pair(hypothesis.first[1],
-                 Expression())).first->second);
-            std::copy((*stack)[base + i].begin() + 1, (*stack)[base + i].end(),
-                      std::back_inserter(subst));
+            std::size_t const var(variableindex(hypothesis.expression[1]));
+            if (var >= context.substitutions.size())
+                context.substitutions.resize(var + 1);
+            context.substitutions[var]
+                = ExpressionRef(*entry.base, entry.first + 1, entry.last);
         }
         else
         {
             // Essential hypothesis
-            Expression dest;
-            makesubstitution(hypothesis.first, substitutions, &dest);
-            if (dest != (*stack)[base + i])
+            if (!matchessubstitution(hypothesis.expression, entry, context))
             {
-                std::cerr << "In proof of theorem "  << thlabel
-                          << " unification failed" << std::endl;
+                err << "In proof of theorem "  << proof.label
+                    << " unification failed" << std::endl;
                 return false;
             }
         }
     }
 
-    // Remove hypotheses from stack
-    stack->erase(stack->begin() + base, stack->end());
-
     // Verify disjoint variable conditions
-    for (std::set<std::pair<std::string, std::string> >::const_iterator
+    for (typename Set<std::pair<Symbol, Symbol> >::const_iterator
          iter(assertion.disjvars.begin());
          iter != assertion.disjvars.end(); ++iter)
     {
-        Expression const & exp1(substitutions.find(iter->first)->second);
-        Expression const & exp2(substitutions.find(iter->second)->second);
-
-        std::set<std::string> exp1vars;
-        for (Expression::const_iterator exp1iter(exp1.begin());
-             exp1iter != exp1.end(); ++exp1iter)
-        {
-            if (variables.find(*exp1iter) != variables.end())
-                exp1vars.insert(*exp1iter);
-        }
+        ExpressionRef const & exp1
+            (context.substitutions[variableindex(iter->first)]);
+        ExpressionRef const & exp2
+            (context.substitutions[variableindex(iter->second)]);
 
-        std::set<std::string> exp2vars;
-        for (Expression::const_iterator exp2iter(exp2.begin());
-             exp2iter != exp2.end(); ++exp2iter)
+        for (std::size_t i(0); i < exp1.size(); ++i)
         {
-            if (variables.find(*exp2iter) != variables.end())
-                exp2vars.insert(*exp2iter);
-        }
+            if (!isvariable(exp1[i]))
+                continue;
 
-        for (std::set<std::string>::const_iterator exp1iter
-            (exp1vars.begin()); exp1iter != exp1vars.end(); ++exp1iter)
-        {
-            for (std::set<std::string>::const_iterator exp2iter
-                (exp2vars.begin()); exp2iter != exp2vars.end(); ++exp2iter)
+            for (std::size_t j(0); j < exp2.size(); ++j)
             {
-                if (!isdvr(*exp1iter, *exp2iter))
+                cost.iterate();
+                if (isvariable(exp2[j]) && !proof.isdvr(exp1[i], exp2[j]))
                 {
-                    std::cerr << "In proof of theorem " << thlabel
-                              << " disjoint variable restriction violated"
-                              << std::endl;
+                    err << "In proof of theorem " << proof.label
+                        << " disjoint variable restriction violated"
+                        << std::endl;
                     return false;
                 }
             }
         }
     }
 
+    // Remove hypotheses from stack
+    stack->erase(stack->begin() + base, stack->end());
+
     // Done verification of this step. Insert new statement onto stack.
-    Expression dest;
-    makesubstitution(assertion.expression, substitutions, &dest);
-    stack->push_back(dest);
+    stack->push_back(makesubstitution(assertion.expression, context));
 
     return true;
 }
 
-// Verify a regular proof. The "proof" argument should be a non-empty sequence
-// of valid labels. Return true iff the proof is correct.
+// Verify a regular proof. The steps should be a non-empty sequence of
+// hypotheses and assertions. Return true iff the proof is correct.
 constexpr bool verifyregularproof
-     (std::string label, Assertion const & theorem,
-      std::vector<std::string> const & proof
-     )
+    (Proof const & proof, ProofContext & context, std::ostream & err) const
 {
-    std::vector<Expression> stack;
-    for (std::vector<std::string>::const_iterator proofstep(proof.begin());
-         proofstep != proof.end(); ++proofstep)
+    context.arena.clear();
+
+    Cost & cost(context.verifyproofcost);
+
+    Vector<ExpressionRef> stack;
+    for (typename Vector<ProofStep>::const_iterator proofstep
+        (proof.steps.begin()); proofstep != proof.steps.end(); ++proofstep)
     {
+        cost.iterate();
+
         // If step is a hypothesis, just push it onto the stack.
-        std::map<std::string, Hypothesis>::const_iterator hyp
-            (hypotheses.find(*proofstep));
-        if (hyp != hypotheses.end())
+        if (proofstep->hypothesis)
         {
-            stack.push_back(hyp->second.first);
+            stack.push_back(ExpressionRef(proofstep->hypothesis->expression));
             continue;
         }
 
         // It must be an axiom or theorem
-        bool const okay(verifyassertionref(label, *proofstep, &stack));
+        bool const okay(verifyassertionref
+            (proof, *proofstep->assertion, &stack, context, err));
         if (!okay)
             return false;
     }
 
     if (stack.size() != 1)
     {
-        std::cerr << "Proof of theorem " << label
-                  << " does not end with only one item on the stack"
-                  << std::endl;
+        err << "Proof of theorem " << proof.label
+            << " does not end with only one item on the stack" << std::endl;
         return false;
     }
 
-    if (stack[0] != theorem.expression)
+    context.wrongstatement = stack[0] != proof.theorem->expression;
+    if (context.wrongstatement)
     {
-        std::cerr << "Proof of theorem " << label << " proves wrong statement"
-                  << std::endl; 
+        err << "Proof of theorem " << proof.label << " proves wrong statement"
+            << std::endl;
     }
 
     return true;
@@ -720,19 +2815,25 @@ constexpr bool verifyregularproof
 
 // Verify a compressed proof
 constexpr bool verifycompressedproof
-    (std::string label, Assertion const & theorem,
-     std::vector<std::string> const & labels,
-     std::vector<std::size_t> const & proofnumbers)
+    (Proof const & proof, ProofContext & context, std::ostream & err) const
 {
-    std::vector<Expression> stack;
+    context.arena.clear();
+
+    Vector<ExpressionRef> stack;
 
+    Assertion const & theorem(*proof.theorem);
     std::size_t const mandhypt(theorem.hypotheses.size());
-    std::size_t const labelt(mandhypt + labels.size());
+    std::size_t const labelt(mandhypt + proof.steps.size());
 
-    std::vector<Expression> savedsteps;
-    for (std::vector<std::size_t>::const_iterator iter(proofnumbers.begin());
-         iter != proofnumbers.end(); ++iter)
+    Cost & cost(context.verifyproofcost);
+
+    Vector<ExpressionRef> savedsteps;
+    for (typename Vector<std::size_t>::const_iterator
+         iter(proof.proofnumbers.begin()); iter != proof.proofnumbers.end();
+         ++iter)
     {
+        cost.iterate();
+
         // Save the last proof step if 0
         if (*iter == 0)
         {
@@ -744,24 +2845,24 @@ constexpr bool verifycompressedproof
         if (*iter <= mandhypt)
         {
             stack.push_back
-                (hypotheses.find(theorem.hypotheses[*iter - 1])->second.first);
+                (ExpressionRef(theorem.hypotheses[*iter - 1]->expression));
         }
         else if (*iter <= labelt)
         {
-            std::string const proofstep(labels[*iter - mandhypt - 1]);
+            ProofStep const & proofstep(proof.steps[*iter - mandhypt - 1]);
 
             // If step is a (non-mandatory) hypothesis,
             // just push it onto the stack.
-            std::map<std::string, Hypothesis>::const_iterator hyp
-            (hypotheses.find(proofstep));
-            if (hyp != hypotheses.end())
+            if (proofstep.hypothesis)
             {
-                stack.push_back(hyp->second.first);
+                stack.push_back
+                    (ExpressionRef(proofstep.hypothesis->expression));
                 continue;
             }
 
             // It must be an axiom or theorem
-            bool const okay(verifyassertionref(label, proofstep, &stack));
+            bool const okay(verifyassertionref
+                (proof, *proofstep.assertion, &stack, context, err));
             if (!okay)
                 return false;
         }
@@ -769,8 +2870,8 @@ constexpr bool verifycompressedproof
         {
             if (*iter > labelt + savedsteps.size())
             {
-                std::cerr << "Number in compressed proof of " << label
-                          << " is too high" << std::endl;
+                err << "Number in compressed proof of " << proof.label
+                    << " is too high" << std::endl;
                 return false;
             }
 
@@ -780,18 +2881,382 @@ constexpr bool verifycompressedproof
 
     if (stack.size() != 1)
     {
-        std::cerr << "Proof of theorem " << label
-                  << " does not end with only one item on the stack"
-                  << std::endl;
+        err << "Proof of theorem " << proof.label
+            << " does not end with only one item on the stack" << std::endl;
+        return false;
+    }
+
+    context.wrongstatement = stack[0] != theorem.expression;
+    if (context.wrongstatement)
+    {
+        err << "Proof of theorem " << proof.label << " proves wrong statement"
+            << std::endl;
+    }
+
+    return true;
+}
+
+// Verify a proof, writing any messages to err. Return true iff the proof is
+// correct. This only reads the proof and the statements it refers to.
+constexpr bool verifyproof
+    (Proof const & proof, ProofContext & context, std::ostream & err) const
+{
+    context.verifyproofcost.call();
+    context.wrongstatement = false;
+
+    if (proof.compressed)
+        return verifycompressedproof(proof, context, err);
+    else
+        return verifyregularproof(proof, context, err);
+}
+
+// A pool of threads which verify proofs while the parser reads on (runtime
+// only). Proofs may be verified in any order, but their messages are kept,
+// and reported in the order of the theorems when the pool is finished.
+struct ProofPool
+{
+    struct Job
+    {
+        Proof proof;
+        bool okay;
+        // Whether it is to be recorded as verified, if it is okay: not if
+        // it proves the wrong statement, or isn't a proof at all
+        bool record;
+        std::string messages;
+    };
+
+    checkmm const & app;
+
+    // Every proof submitted, in order. Jobs before next have been taken by
+    // a thread, and done of them are finished.
+    std::deque<Job> queue;
+    std::size_t next;
+    std::size_t done;
+
+    // The number of unfinished jobs the parser may get ahead by
+    std::size_t backlog;
+
+    bool finishing;
+
+    // The first job known to have failed. Only the jobs after it are
+    // skipped, so that every job before the first failure is verified.
+    std::size_t firstfailed;
+
+    // Set once a proof fails to verify
+    std::atomic<bool> failed;
+
+    // What the parser has written since the proof last submitted: std::cerr
+    // is redirected here while it parses
+    std::ostringstream parsermessages;
+
+    // The work done by the threads which have finished, if profiling
+    Cost verifyproofcost;
+    Cost verifyassertionrefcost;
+
+    std::mutex mutex;
+    std::condition_variable workready;
+    std::condition_variable jobdone;
+    std::vector<std::thread> threads;
+
+    ProofPool(checkmm const & a, unsigned const jobs)
+        : app(a), next(0), done(0), backlog(16 * jobs), finishing(false),
+          firstfailed(std::numeric_limits<std::size_t>::max()), failed(false)
+    {
+        for (unsigned i(0); i < jobs; ++i)
+            threads.emplace_back(&ProofPool::work, this);
+    }
+
+    ~ProofPool() { join(); }
+
+    // Queue a proof to be verified, taking its contents. This waits while
+    // the backlog is full, so that memory use stays bounded.
+    void submit(Proof & proof)
+    {
+        report(true);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (queue.size() - done >= backlog)
+            jobdone.wait(lock);
+        queue.push_back(Job{std::move(proof), true, true, std::string()});
+        lock.unlock();
+        workready.notify_one();
+    }
+
+    // Queue the parser's messages since the proof last submitted, if any,
+    // to be reported after the proofs queued before them, and only if none
+    // of those failed; okay is false if parsing failed. The job has no
+    // theorem, so it isn't verified.
+    void report(bool const okay)
+    {
+        std::string const messages(parsermessages.str());
+        if (okay && messages.empty())
+            return;
+        parsermessages.str(std::string());
+
+        {
+            std::lock_guard<std::mutex> const lock(mutex);
+            queue.push_back(Job{Proof(), okay, false, messages});
+        }
+        workready.notify_one();
+    }
+
+    void work()
+    {
+        ProofContext context;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            while (!finishing && next == queue.size())
+                workready.wait(lock);
+            if (next == queue.size())
+            {
+                verifyproofcost += context.verifyproofcost;
+                verifyassertionrefcost += context.verifyassertionrefcost;
+                return;
+            }
+
+            std::size_t const index(next++);
+            Job & job(queue[index]);
+            bool const skip(index > firstfailed || !job.proof.theorem);
+            lock.unlock();
+
+            if (!skip)
+            {
+                std::ostringstream messages;
+                job.okay = app.verifyproof(job.proof, context, messages);
+                job.record = !context.wrongstatement;
+                job.messages = messages.str();
+            }
+            // Release its storage, keeping its label and hash
+            Vector<std::pair<Symbol, Symbol> >()
+                .swap(job.proof.disjvars);
+            Vector<ProofStep>().swap(job.proof.steps);
+            Vector<std::size_t>().swap(job.proof.proofnumbers);
+
+            lock.lock();
+            if (!job.okay && index < firstfailed)
+            {
+                firstfailed = index;
+                failed = true;
+            }
+            ++done;
+            jobdone.notify_all();
+        }
+    }
+
+    void join()
+    {
+        {
+            std::lock_guard<std::mutex> const lock(mutex);
+            finishing = true;
+        }
+        workready.notify_all();
+
+        for (std::vector<std::thread>::iterator iter(threads.begin());
+             iter != threads.end(); ++iter)
+        {
+            if (iter->joinable())
+                iter->join();
+        }
+    }
+
+    // Wait for every proof queued to be verified, then report messages in
+    // the order of the theorems, up to the first proof which failed. The
+    // proofs verified without any message are added to verified. Return
+    // true iff every proof was verified.
+    bool finish(std::map<std::string, Hash, std::less<> > & verified)
+    {
+        join();
+
+        for (typename std::deque<Job>::const_iterator iter(queue.begin());
+             iter != queue.end(); ++iter)
+        {
+            std::cerr << iter->messages;
+            if (!iter->okay)
+                return false;
+            if (iter->record)
+                verified[std::string(iter->proof.label)] = iter->proof.hash;
+        }
+
+        return true;
+    }
+};
+
+// Verify proofs on this many threads, if more than one
+unsigned jobs = 1;
+
+// Check only the proofs of every parts'th theorem, starting from the
+// part'th (counting from 0), so that verification can be split between
+// compilations. Every statement is still read.
+std::size_t part = 0;
+std::size_t parts = 1;
+std::size_t theoremcount = 0;
+
+std::unique_ptr<ProofPool> pool;
+
+// The file recording the proofs verified, if any (runtime only)
+std::string cachefile;
+
+// The resource counting the allocations of the verifier's containers, if
+// profiling (runtime only)
+CountingResource const * allocationcounter = nullptr;
+
+// The hash of each proof verified by this run or an earlier one, by label
+std::map<std::string, Hash, std::less<> > cachedproofs;
+
+// Hash a proof, with the assertion it proves and the statements it cites.
+// Assertions are hashed by statement and frame only, so a change to a
+// proof doesn't invalidate the proofs citing the theorem it proves.
+static constexpr Hash hashproof(Proof const & proof)
+{
+    Hash hash(hashvalue(hashbasis, proof.theorem->hash));
+
+    hash = hashvalue(hash, proof.activedisjvars->size());
+    for (typename Set<std::pair<Symbol, Symbol> >::const_iterator
+         iter(proof.activedisjvars->begin());
+         iter != proof.activedisjvars->end(); ++iter)
+    {
+        hash = hashvalue(hash, iter->first);
+        hash = hashvalue(hash, iter->second);
+    }
+
+    hash = hashvalue(hash, proof.compressed);
+    hash = hashvalue(hash, proof.steps.size());
+    for (typename Vector<ProofStep>::const_iterator
+         iter(proof.steps.begin()); iter != proof.steps.end(); ++iter)
+    {
+        if (iter->hypothesis)
+            hash = hashhypothesis(hashvalue(hash, 'h'), *iter->hypothesis);
+        else
+            hash = hashvalue(hashvalue(hash, 'a'), iter->assertion->hash);
+    }
+
+    hash = hashvalue(hash, proof.proofnumbers.size());
+    for (typename Vector<std::size_t>::const_iterator
+         iter(proof.proofnumbers.begin()); iter != proof.proofnumbers.end();
+         ++iter)
+    {
+        hash = hashvalue(hash, *iter);
+    }
+
+    return hash;
+}
+
+// Read the proofs verified by an earlier run. A missing, unreadable or
+// malformed cache is treated as empty.
+bool readcache()
+{
+    std::ifstream in(cachefile);
+    std::string line;
+    if (!std::getline(in, line) || line != "checkmm-cache 1")
+        return false;
+
+    bool okay(true);
+    while (okay && std::getline(in, line))
+    {
+        std::string::size_type const space(line.find(' '));
+        okay = space != std::string::npos;
+
+        Hash hash;
+        if (okay)
+        {
+            char const * const end(line.data() + line.size());
+            std::from_chars_result const result
+                (std::from_chars(line.data() + space + 1, end, hash, 16));
+            okay = result.ec == std::errc() && result.ptr == end;
+        }
+
+        if (okay)
+            cachedproofs.emplace_hint
+                (cachedproofs.end(), line.substr(0, space), hash);
+    }
+
+    if (!okay)
+        cachedproofs.clear();
+
+    return okay;
+}
+
+// Record the proofs verified by this run, with those of earlier runs. It
+// is written with replacefile, so it is never seen partly written.
+bool writecache()
+{
+    std::ostringstream out;
+    out << "checkmm-cache 1\n" << std::hex;
+    for (std::map<std::string, Hash, std::less<> >::const_iterator
+         iter(cachedproofs.begin()); iter != cachedproofs.end(); ++iter)
+    {
+        out << iter->first << ' ' << iter->second << '\n';
+    }
+
+    if (!replacefile(cachefile, out.str()))
+    {
+        std::cerr << "Couldn't write cache " << cachefile << std::endl;
         return false;
     }
 
-    if (stack[0] != theorem.expression)
+    return true;
+}
+
+// Verify a proof as it is read, or queue it for the pool, which takes its
+// contents. A proof verified by an earlier run is skipped; one which proves
+// the wrong statement isn't recorded, so that it is reported again. Return
+// false iff it is known to be incorrect.
+constexpr bool submitproof(Proof & proof)
+{
+    if (!cachefile.empty())
+    {
+        proof.hash = hashproof(proof);
+        std::map<std::string, Hash, std::less<> >::const_iterator const cached
+            (cachedproofs.find(std::string_view(proof.label)));
+        if (cached != cachedproofs.end() && cached->second == proof.hash)
+            return true;
+    }
+
+    if (pool)
+    {
+        proof.disjvars.assign(proof.activedisjvars->begin(),
+                              proof.activedisjvars->end());
+        proof.activedisjvars = nullptr;
+        pool->submit(proof);
+        return true;
+    }
+
+    bool const okay(verifyproof(proof, context, std::cerr));
+    if (okay && !context.wrongstatement && !cachefile.empty())
+        cachedproofs[std::string(proof.label)] = proof.hash;
+
+    return okay;
+}
+
+// Resolve a label in a proof, which should be that of an assertion or an
+// active hypothesis.
+constexpr ProofStep getproofstep(std::string const & label) const
+{
+    typename namemap<Hypothesis>::const_iterator const hyp
+        (hypotheses.find(label));
+    if (hyp != hypotheses.end())
+        return ProofStep{&hyp->second, nullptr};
+
+    return ProofStep{nullptr, &assertions.find(label)->second};
+}
+
+// Skip the proof of a $p statement which is in another part, up to its $.
+// token. Return true iff okay.
+constexpr bool skipproof(std::string const & label)
+{
+    while (!tokens.empty() && tokens.frontkind() != endtoken)
+        tokens.pop();
+
+    if (tokens.empty())
     {
-        std::cerr << "Proof of theorem " << label << " proves wrong statement"
-                  << std::endl; 
+        std::cerr << "Unfinished $p statement " << label << std::endl;
+        return false;
     }
 
+    tokens.pop(); // Discard $. token
+
     return true;
 }
 
@@ -799,7 +3264,7 @@ constexpr bool verifycompressedproof
 constexpr bool parsep(std::string label)
 {
     Expression newtheorem;
-    bool const okay(readexpression('p', label, "$=", &newtheorem));
+    bool const okay(readexpression('p', label, prooftoken, &newtheorem));
     if (!okay)
     {
         return false;
@@ -807,36 +3272,48 @@ constexpr bool parsep(std::string label)
 
     Assertion const & assertion(constructassertion(label, newtheorem));
 
+    if (theoremcount++ % parts != part)
+        return skipproof(label);
+
     // Now for the proof
 
+    Proof newproof;
+    newproof.label = label;
+    newproof.theorem = &assertion;
+    newproof.activedisjvars = &disjvars;
+    newproof.hash = 0;
+
     if (tokens.empty())
     {
         std::cerr << "Unfinished $p statement " << label << std::endl;
         return false;
     }
 
-    if (tokens.front() == "(")
+    if (tokens.frontkind() == openparentoken)
     {
         // Compressed proof
         tokens.pop();
 
         // Get labels
 
-        std::vector<std::string> labels;
+        newproof.compressed = true;
         std::string token;
-        while (!tokens.empty() && (token = tokens.front()) != ")")
+        while (!tokens.empty() && tokens.frontkind() != closeparentoken)
         {
+            token = tokens.front();
             tokens.pop();
-            labels.push_back(token);
+            typename namemap<Hypothesis>::const_iterator const hyp
+                (hypotheses.find(token));
             if (token == label)
             {
                 std::cerr << "Proof of theorem " << label
                           << " refers to itself" << std::endl;
                 return false;
             }
-            else if (std::find
+            else if (hyp != hypotheses.end()
+                  && std::find
                     (assertion.hypotheses.begin(), assertion.hypotheses.end(),
-                     token) != assertion.hypotheses.end())
+                     &hyp->second) != assertion.hypotheses.end())
             {
                 std::cerr << "Compressed proof of theorem " << label
                           << " has mandatory hypothesis " << token
@@ -851,6 +3328,7 @@ constexpr bool parsep(std::string label)
                           << std::endl;
                 return false;
             }
+            newproof.steps.push_back(getproofstep(token));
         }
 
         if (tokens.empty())
@@ -864,12 +3342,14 @@ constexpr bool parsep(std::string label)
         // Get proof steps
 
         std::string proof;
-        while (!tokens.empty() && (token = tokens.front()) != "$.")
+        while (!tokens.empty() && tokens.frontkind() != endtoken)
         {
+            bool const upperorq(tokens.frontclass().upperorq);
+            token = tokens.front();
             tokens.pop();
 
             proof += token;
-            if (!containsonlyupperorq(token))
+            if (!upperorq)
             {
                 std::cerr << "Bogus character found in compressed proof of "
                           << label << std::endl;
@@ -898,28 +3378,33 @@ constexpr bool parsep(std::string label)
             return true; // Continue processing file
         }
 
-        std::vector<std::size_t> proofnumbers;
+        Vector<std::size_t> & proofnumbers(newproof.proofnumbers);
         proofnumbers.reserve(proof.size()); // Preallocate for efficiency
         bool okay(getproofnumbers(label, proof, &proofnumbers));
         if (!okay)
             return false;
 
-        okay = verifycompressedproof(label, assertion, labels, proofnumbers);
+        okay = submitproof(newproof);
         if (!okay)
             return false;
     }
     else
     {
         // Regular (uncompressed proof)
-        std::vector<std::string> proof;
+        newproof.compressed = false;
+        Vector<ProofStep> & proof(newproof.steps);
         bool incomplete(false);
         std::string token;
-        while (!tokens.empty() && (token = tokens.front()) != "$.")
+        while (!tokens.empty() && tokens.frontkind() != endtoken)
         {
+            TokenKind const kind(tokens.frontkind());
+            token = tokens.front();
             tokens.pop();
-            proof.push_back(token);
-            if (token == "?")
+            if (kind == unknownsteptoken)
+            {
+                proof.push_back(ProofStep{nullptr, nullptr});
                 incomplete = true;
+            }
             else if (token == label)
             {
                 std::cerr << "Proof of theorem " << label
@@ -934,6 +3419,8 @@ constexpr bool parsep(std::string label)
                           << std::endl;
                 return false;
             }
+            else
+                proof.push_back(getproofstep(token));
         }
 
         if (tokens.empty())
@@ -957,7 +3444,7 @@ constexpr bool parsep(std::string label)
             return true; // Continue processing file
         }
 
-        bool okay(verifyregularproof(label, assertion, proof));
+        bool okay(submitproof(newproof));
         if (!okay)
             return false;
     }
@@ -969,15 +3456,15 @@ constexpr bool parsep(std::string label)
 constexpr bool parsee(std::string label)
 {
     Expression newhyp;
-    bool const okay(readexpression('e', label, "$.", &newhyp));
+    bool const okay(readexpression('e', label, endtoken, &newhyp));
     if (!okay)
     {
         return false;
     }
 
     // Create new essential hypothesis
-    hypotheses.insert(std::make_pair(label, std::make_pair(newhyp, false)));
-    scopes.back().activehyp.push_back(label);
+    hypotheses.insert(std::make_pair(label, Hypothesis{newhyp, false, true}));
+    scopes.back().activehyp.push_back(String(label));
 
     return true;
 }
@@ -986,7 +3473,7 @@ constexpr bool parsee(std::string label)
 constexpr bool parsea(std::string label)
 {
     Expression newaxiom;
-    bool const okay(readexpression('a', label, "$.", &newaxiom));
+    bool const okay(readexpression('a', label, endtoken, &newaxiom));
     if (!okay)
     {
         return false;
@@ -1008,7 +3495,8 @@ constexpr bool parsef(std::string label)
 
     std::string type(tokens.front());
 
-    if (constants.find(type) == constants.end())
+    Symbol const typesym(findsymbol(type));
+    if (!isconstant(typesym))
     {
         std::cerr << "First symbol in $f statement " << label << " is "
                   << type << " which is not a constant" << std::endl;
@@ -1024,14 +3512,15 @@ constexpr bool parsef(std::string label)
     }
 
     std::string variable(tokens.front());
-    if (!isactivevariable(variable))
+    Symbol const varsym(findsymbol(variable));
+    if (!isvariable(varsym) || !isactivevariable(varsym))
     {
         std::cerr << "Second symbol in $f statement " << label << " is "
                   << variable << " which is not an active variable"
                   << std::endl;
         return false;
     }
-    if (!getfloatinghyp(variable).empty())
+    if (!getfloatinghyp(varsym).empty())
     {
         std::cerr << "The variable " << variable
                   << " appears in a second $f statement "
@@ -1047,7 +3536,7 @@ constexpr bool parsef(std::string label)
         return false;
     }
 
-    if (tokens.front() != "$.")
+    if (tokens.frontkind() != endtoken)
     {
         std::cerr << "Expected end of $f statement " << label
                   << " but found " << tokens.front() << std::endl;
@@ -1058,11 +3547,12 @@ constexpr bool parsef(std::string label)
 
     // Create new floating hypothesis
     Expression newhyp;
-    newhyp.push_back(type);
-    newhyp.push_back(variable);
-    hypotheses.insert(std::make_pair(label, std::make_pair(newhyp, true)));
-    scopes.back().activehyp.push_back(label);
-    scopes.back().floatinghyp.insert(std::make_pair(variable, label));
+    newhyp.push_back(typesym);
+    newhyp.push_back(varsym);
+    hypotheses.insert(std::make_pair(label, Hypothesis{newhyp, true, true}));
+    scopes.back().activehyp.push_back(String(label));
+    scopes.back().floatinghyp.insert(std::make_pair(varsym, label));
+    floatinghyps[variableindex(varsym)] = label;
 
     return true;
 }
@@ -1070,14 +3560,16 @@ constexpr bool parsef(std::string label)
 // Parse labeled statement. Return true iff okay.
 constexpr bool parselabel(std::string label)
 {
-    if (constants.find(label) != constants.end())
+    Symbol const sym(findsymbol(label));
+
+    if (isconstant(sym))
     {
         std::cerr << "Attempt to reuse constant " << label << " as a label"
                   << std::endl;
         return false;
     }
 
-    if (variables.find(label) != variables.end())
+    if (isvariable(sym))
     {
         std::cerr << "Attempt to reuse variable " << label << " as a label"
                   << std::endl;
@@ -1096,28 +3588,26 @@ constexpr bool parselabel(std::string label)
         return false;
     }
 
+    TokenKind const kind(tokens.frontkind());
     std::string const type(tokens.front());
     tokens.pop();
 
     bool okay(true);
-    if (type == "$p")
+    switch (kind)
     {
+    case provabletoken:
         okay = parsep(label);
-    }
-    else if (type == "$e")
-    {
+        break;
+    case essentialtoken:
         okay = parsee(label);
-    }
-    else if (type == "$a")
-    {
+        break;
+    case axiomtoken:
         okay = parsea(label);
-    }
-    else if (type == "$f")
-    {
+        break;
+    case floatingtoken:
         okay = parsef(label);
-    }
-    else
-    {
+        break;
+    default:
         std::cerr << "Unexpected token " << type << " encountered"
                   << std::endl;
         return false;
@@ -1129,22 +3619,24 @@ constexpr bool parselabel(std::string label)
 // Parse $d statement. Return true iff okay.
 constexpr bool parsed()
 {
-    std::set<std::string> dvars;
+    Set<Symbol> dvars;
 
     std::string token;
 
-    while (!tokens.empty() && (token = tokens.front()) != "$.")
+    while (!tokens.empty() && tokens.frontkind() != endtoken)
     {
+        token = tokens.front();
         tokens.pop();
 
-        if (!isactivevariable(token))
+        Symbol const sym(findsymbol(token));
+        if (!isvariable(sym) || !isactivevariable(sym))
         {
             std::cerr << "Token " << token << " is not an active variable, "
                       << "but was found in a $d statement" << std::endl;
             return false;
         }
 
-        bool const duplicate(!dvars.insert(token).second);
+        bool const duplicate(!dvars.insert(sym).second);
         if (duplicate)
         {
             std::cerr << "$d statement mentions " << token << " twice"
@@ -1166,7 +3658,18 @@ constexpr bool parsed()
     }
 
     // Record it
-    scopes.back().disjvars.push_back(dvars);
+    for (typename Set<Symbol>::const_iterator iter(dvars.begin());
+         iter != dvars.end(); ++iter)
+    {
+        typename Set<Symbol>::const_iterator iter2(iter);
+        ++iter2;
+        for (; iter2 != dvars.end(); ++iter2)
+        {
+            std::pair<Symbol, Symbol> const dvpair(*iter, *iter2);
+            if (disjvars.insert(dvpair).second)
+                scopes.back().disjvars.push_back(dvpair);
+        }
+    }
 
     tokens.pop(); // Discard $. token
 
@@ -1185,18 +3688,21 @@ constexpr bool parsec()
 
     std::string token;
     bool listempty(true);
-    while (!tokens.empty() && (token = tokens.front()) != "$.")
+    while (!tokens.empty() && tokens.frontkind() != endtoken)
     {
+        bool const mathsymbol(tokens.frontclass().mathsymbol);
+        token = tokens.front();
         tokens.pop();
         listempty = false;
 
-        if (!ismathsymboltoken(token))
+        if (!mathsymbol)
         {
             std::cerr << "Attempt to declare " << token
                       << " as a constant" << std::endl;
             return false;
         }
-        if (variables.find(token) != variables.end())
+        Symbol const sym(findsymbol(token));
+        if (isvariable(sym))
         {
             std::cerr << "Attempt to redeclare variable " << token
                       << " as a constant" << std::endl;
@@ -1208,13 +3714,14 @@ constexpr bool parsec()
                       << " as a constant" << std::endl;
             return false;
         }
-        bool const alreadydeclared(!constants.insert(token).second);
+        bool const alreadydeclared(sym != nosymbol);
         if (alreadydeclared)
         {
             std::cerr << "Attempt to redeclare constant " << token
                       << std::endl;
             return false;
         }
+        addsymbol(token, true);
     }
 
     if (tokens.empty())
@@ -1239,18 +3746,21 @@ constexpr bool parsev()
 {
     std::string token;
     bool listempty(true);
-    while (!tokens.empty() && (token = tokens.front()) != "$.")
+    while (!tokens.empty() && tokens.frontkind() != endtoken)
     {
+        bool const mathsymbol(tokens.frontclass().mathsymbol);
+        token = tokens.front();
         tokens.pop();
         listempty = false;
 
-        if (!ismathsymboltoken(token))
+        if (!mathsymbol)
         {
             std::cerr << "Attempt to declare " << token
                       << " as a variable" << std::endl;
             return false;
         }
-        if (constants.find(token) != constants.end())
+        Symbol sym(findsymbol(token));
+        if (isconstant(sym))
         {
             std::cerr << "Attempt to redeclare constant " << token
                       << " as a variable" << std::endl;
@@ -1262,15 +3772,17 @@ constexpr bool parsev()
                       << " as a variable" << std::endl;
             return false;
         }
-        bool const alreadyactive(isactivevariable(token));
+        bool const alreadyactive(sym != nosymbol && isactivevariable(sym));
         if (alreadyactive)
         {
             std::cerr << "Attempt to redeclare active variable " << token
                       << std::endl;
             return false;
         }
-        variables.insert(token);
-        scopes.back().activevariables.insert(token);
+        if (sym == nosymbol)
+            sym = addsymbol(token, false);
+        scopes.back().activevariables.insert(sym);
+        activevariables[variableindex(sym)] = true;
     }
 
     if (tokens.empty())
@@ -1290,66 +3802,153 @@ constexpr bool parsev()
     return true;
 }
 
-constexpr int run(std::string const filename, std::string const &text = "")
+// Parse the statements of the database, with the parser's messages queued
+// for the pool as each proof is submitted, so that they are reported after
+// the messages of the proofs read before them, and not at all if one of
+// those fails. Only this thread writes to std::cerr while parsing, so it is
+// redirected meanwhile. Return true iff okay (runtime only).
+bool parsestatementsqueued()
 {
-    bool const okay(readtokens(filename, text));
-    if (!okay)
-        return EXIT_FAILURE;
+    std::streambuf * const cerrbuf
+        (std::cerr.rdbuf(pool->parsermessages.rdbuf()));
+    bool const okay(parsestatements());
+    std::cerr.rdbuf(cerrbuf);
+
+    pool->report(okay);
+
+    return okay;
+}
 
+// Parse the statements of the database. Return true iff okay; proofs
+// queued for the pool may still fail.
+constexpr bool parsestatements()
+{
     scopes.push_back(Scope());
 
     while (!tokens.empty())
     {
+        // Stop reading once a queued proof has failed, as would have
+        // happened had it been verified as it was read.
+        if (pool && pool->failed)
+            return true;
+
+        TokenClass const tokenclass(tokens.frontclass());
         std::string const token(tokens.front());
         tokens.pop();
 
         bool okay(true);
 
-        if (islabeltoken(token))
+        if (tokenclass.label)
         {
             okay = parselabel(token);
         }
-        else if (token == "$d")
-        {
-            okay = parsed();
-        }
-        else if (token == "${")
-        {
-            scopes.push_back(Scope());
-        }
-        else if (token == "$}")
+        else
         {
-            scopes.pop_back();
-            if (scopes.empty())
+            switch (tokenclass.kind)
             {
-                std::cerr << "$} without corresponding ${" << std::endl;
-                return EXIT_FAILURE;
+            case disjointtoken:
+                okay = parsed();
+                break;
+            case openscopetoken:
+                scopes.push_back(Scope());
+                break;
+            case closescopetoken:
+                endscope();
+                if (scopes.empty())
+                {
+                    std::cerr << "$} without corresponding ${" << std::endl;
+                    return false;
+                }
+                break;
+            case constanttoken:
+                okay = parsec();
+                break;
+            case variabletoken:
+                okay = parsev();
+                break;
+            default:
+                std::cerr << "Unexpected token " << token << " encountered"
+                          << std::endl;
+                return false;
             }
         }
-        else if (token == "$c")
-        {
-            okay = parsec();
-        }
-        else if (token == "$v")
-        {
-            okay = parsev();
-        }
-        else
-        {
-            std::cerr << "Unexpected token " << token << " encountered"
-                      << std::endl;
-            return EXIT_FAILURE;
-        }
         if (!okay)
-            return EXIT_FAILURE;
+            return false;
     }
 
+    if (tokens.failed)
+        return false;
+
     if (scopes.size() > 1)
     {
         std::cerr << "${ without corresponding $}" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Report the work done by the functions profiled
+constexpr void printprofile() const
+{
+    std::cerr << "Profile: calls, iterations" << std::endl;
+    printcost("readtokens", tokens.readtokenscost);
+    printcost("constructassertion", constructassertioncost);
+    printcost("verifyproof", context.verifyproofcost);
+    printcost("verifyassertionref", context.verifyassertionrefcost);
+    if (allocationcounter)
+        std::cerr << "  allocations: " << allocationcounter->allocations
+                  << std::endl;
+}
+
+constexpr void printcost(std::string const & name, Cost const & cost) const
+{
+    std::cerr << "  " << name << ": " << cost.calls << ", "
+              << cost.iterations << std::endl;
+}
+
+constexpr int run(std::string const filename,
+                  std::string_view const text = {})
+{
+    tokens.lexthreads = jobs;
+
+    bool okay(tokens.readtokens(filename, text));
+    if (!okay)
+    {
+        tokens.stopreading();
         return EXIT_FAILURE;
     }
 
+    if (!cachefile.empty())
+        readcache();
+
+    if (jobs > 1)
+        pool.reset(new ProofPool(*this, jobs));
+
+    okay = pool ? parsestatementsqueued() : parsestatements();
+
+    tokens.stopreading();
+
+    bool verified(true);
+    if (pool)
+    {
+        verified = pool->finish(cachedproofs);
+        context.verifyproofcost += pool->verifyproofcost;
+        context.verifyassertionrefcost += pool->verifyassertionrefcost;
+        pool.reset();
+    }
+
+    // The profile can only be printed at runtime
+    if (profiling && !std::is_constant_evaluated())
+        printprofile();
+
+    // Proofs verified are recorded even if others failed
+    if (!cachefile.empty() && !writecache())
+        return EXIT_FAILURE;
+
+    if (!okay || !verified)
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }
 
@@ -1360,17 +3959,42 @@ constexpr int run(std::string const filename, std::string const &text = "")
 
 constexpr int app_run()
 {
-    checkmm app;
+    checkmm<> app;
 //    std::string txt = R"($( Declare the constant symbols we will use $)
 //                        $c 0 + = -> ( ) term wff |- $.)";
 //    std::string txt = "$c 0 + = -> ( ) term wff |- $.";
 //    std::string txt = "$( The comment is not closed!";
 
-#ifdef MMFILEPATH
-    std::string txt =
+#if defined(CHECKMM_PART) && !defined(CHECKMM_PARTS)
+#error "CHECKMM_PART needs CHECKMM_PARTS, the number of parts"
+#endif
+#ifdef CHECKMM_PARTS
+#ifndef CHECKMM_PART
+#error "CHECKMM_PARTS needs CHECKMM_PART, the part to be checked"
+#endif
+    static_assert(CHECKMM_PART < CHECKMM_PARTS,
+                  "CHECKMM_PART must be less than CHECKMM_PARTS");
+    app.part = CHECKMM_PART;
+    app.parts = CHECKMM_PARTS;
+#endif
+
+#if defined(MMEMBEDPATH) && defined(__has_embed)
+    // The bytes of the file itself. A newline is appended so that an empty
+    // file still makes an array; as the elements are chars, a byte outside
+    // ASCII is rejected by the compiler as a narrowing conversion.
+    static constexpr char txt[] = {
+#embed xstr(MMEMBEDPATH) suffix(,)
+        '\n'
+    };
+    int ret = app.run("", std::string_view(txt, sizeof txt));
+#elif defined(MMFILEPATH)
+    // The text is lexed in place, without being copied or measured
+    static constexpr char txt[] =
 #include xstr(MMFILEPATH)
 ;
-    int ret = app.run("", txt);
+    int ret = app.run("", std::string_view(txt, sizeof txt - 1));
+#elif defined(MMEMBEDPATH)
+#error "MMEMBEDPATH needs #embed; define MMFILEPATH (see delimit.sh) instead"
 #else
     int ret = EXIT_SUCCESS;
 #endif
@@ -1380,15 +4004,86 @@ constexpr int app_run()
 
 int main(int argc, char ** argv)
 {
+    bool pretokenize(false);
+    unsigned jobs(1);
+    std::string cachefile;
+
+    while (argc >= 3)
+    {
+        std::string const option(argv[1]);
+        if (option == "--mmb")
+        {
+            pretokenize = true;
+            ++argv;
+            --argc;
+            continue;
+        }
+        else if (argc < 4)
+            break;
+        else if (option == "--jobs")
+        {
+            char * end;
+            unsigned long const count(std::strtoul(argv[2], &end, 10));
+            if (*argv[2] == '\0' || *end != '\0' || count == 0
+             || count > 1024)
+            {
+                std::cerr << "Invalid number of jobs " << argv[2]
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            jobs = static_cast<unsigned>(count);
+        }
+        else if (option == "--cache")
+        {
+            cachefile = argv[2];
+        }
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc != 2)
     {
-        std::cerr << "Syntax: checkmm <filename>" << std::endl;
+        std::cerr << "Syntax: checkmm [--jobs N] [--cache FILE] [--mmb] "
+                     "<filename>" << std::endl;
         return EXIT_FAILURE;
     }
 
     static_assert(EXIT_SUCCESS == app_run());
 
-    checkmm app;
+    // All of the verifier's containers are allocated from a pool over an
+    // arena: the name maps are given the pool, and the rest take it as the
+    // default resource of their polymorphic allocators. The database is only
+    // freed at exit, but proofs and their stacks are freed as they are
+    // verified, and the pool reuses their memory. With more than one job,
+    // proofs are allocated by the parser and verified and freed on the proof
+    // pool's threads, so the pool must then be a synchronized one; it calls on
+    // the arena under its own lock. Nor is the verifier destroyed: its
+    // millions of nodes would be freed one by one, just before the process
+    // exits, which frees them all at once anyway. (They stay reachable, from
+    // static pointers, so leak checkers don't report them.)
+    static std::pmr::monotonic_buffer_resource * const arena
+        (new std::pmr::monotonic_buffer_resource(std::size_t(1) << 20));
+    static std::pmr::memory_resource * const pool
+        (jobs > 1 ? static_cast<std::pmr::memory_resource *>
+                        (new std::pmr::synchronized_pool_resource(arena))
+                  : new std::pmr::unsynchronized_pool_resource(arena));
+    // If profiling, the allocations are counted on their way to the pool.
+    static CountingResource * const counter
+        (checkmm<HashedContainers>::profiling ? new CountingResource(pool)
+                                              : nullptr);
+    std::pmr::memory_resource * const resource
+        (counter ? static_cast<std::pmr::memory_resource *>(counter) : pool);
+    std::pmr::set_default_resource(resource);
+    static checkmm<HashedContainers> * const verifier
+        (new checkmm<HashedContainers>(HashedContainers{resource}));
+    checkmm<HashedContainers> & app(*verifier);
+    app.allocationcounter = counter;
+    app.tokens.pretokenize = pretokenize;
+    app.jobs = jobs;
+    app.cachefile = cachefile;
+
     int ret = app.run(argv[1]);
 
     return ret;